@@ -1,76 +1,3290 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include "crc32c.h"
+#include "frame.h"
+#include "lineidx.h"
+#include "lz4enc.h"
+#include "nlscan.h"
+
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-static void usage(const char *progname) {
-    fprintf(stderr, "Usage: %s [-a] file\n", progname);
-    exit(EXIT_FAILURE);
+#define SYNC_KICK (1024 * 1024)   /* start writeback every 1 MB of dirty data */
+#define STREAM_WINDOW (8 * 1024 * 1024)   /* default --stream window */
+#define DIO_ALIGN 4096                    /* O_DIRECT offset/length alignment */
+#define DIO_BUF (1024 * 1024)             /* size of each O_DIRECT staging buffer */
+#define PREALLOC_CHUNK (64 * 1024 * 1024) /* default --prealloc extent size */
+#define MAP_WINDOW (16 * 1024 * 1024)     /* default --mmap window size */
+#define CONC_BUF (64 * 1024)              /* per-producer record buffer */
+#define CONC_EVENTS 64                    /* producers serviced per epoll_wait */
+#define CONC_MAX_FIFOS 64
+#define IDX_BATCH 512                     /* index entries written at a time */
+#define MAX_ROUTES 16
+#define LINE_OFFS 1024                    /* newlines located per nl_scan() call */
+#define VMS_BUF (64 * 1024)               /* --vmsplice buffer size */
+#define BACKLOG_MAX (64 * 1024 * 1024)    /* default --nonblock backlog */
+#define TAP_RING (8 * 1024 * 1024)        /* recent data kept for --tap clients */
+#define TEE_LAG (64 * 1024 * 1024)        /* default --max-lag */
+#define MAX_FILES 16
+
+/* ---- durability policy -------------------------------------------------- */
+
+enum sync_mode { SYNC_NONE, SYNC_INTERVAL, SYNC_BYTES, SYNC_EVERY };
+
+struct sync_policy {
+    enum sync_mode mode;
+    long long arg;              /* milliseconds or bytes, depending on mode */
+};
+
+/*
+ * O_DIRECT writer state.  The main thread copies incoming data into one
+ * aligned staging buffer while a writer thread pwrite()s the other, so the
+ * device write of one buffer overlaps with reading the next.
+ */
+struct dio {
+    char *buf[2];
+    int cur;                    /* buffer the main thread is filling */
+    size_t fill;                /* bytes staged in buf[cur] */
+    off_t base;                 /* file offset where buf[cur] will land */
+
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    const char *job;            /* buffer handed to the writer, NULL if idle */
+    size_t job_len;
+    off_t job_off;
+    int err;                    /* errno of a failed write, sticky */
+    int quit;
+};
+
+/*
+ * Built-in LZ4 compression of the file.  Like the O_DIRECT writer, the main
+ * thread fills one input block while a worker compresses the other and
+ * writes it out, so all file I/O happens on the worker while it runs.
+ */
+struct lz {
+    unsigned char *in[2];
+    int cur;                    /* block the main thread is filling */
+    size_t fill;
+    unsigned char *out;
+    uint32_t *table;
+
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    const unsigned char *job;   /* block handed to the worker, NULL if idle */
+    size_t job_len;             /* 0: no data, just apply the sync policy */
+    int job_sync;               /* sync once the block is written */
+    long long unsynced;         /* bytes taken in since the last forced sync */
+    int busy;
+    int err;                    /* errno of a failed write, sticky */
+    int quit;
+};
+
+/* Closed segments waiting for the background compressor. */
+struct zjob {
+    struct zjob *next;
+    char path[];
+};
+
+struct compressor {
+    const char *cmd;            /* shell command, the segment path is "$1" */
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct zjob *head, **tail;
+    int quit;
+};
+
+enum frame_mode { FRAME_NONE, FRAME_CHUNK, FRAME_LINE };
+
+/*
+ * Record framing for the file.  Headers and payload pointers are gathered
+ * into one iovec list so a whole batch of records goes out in one write.
+ * In line mode a line split across two reads waits in carry.
+ */
+struct framer {
+    enum frame_mode mode;
+    char *carry;
+    size_t carry_len, carry_cap;
+    int carry_busy;             /* out[] still points into carry */
+    struct iovec out[IOV_MAX];
+    int nout;
+    unsigned char hdr[IOV_MAX / 2][FRAME_HDR];
+    int nhdr;
+};
+
+/*
+ * Sparse line index (see lineidx.h).  The first bytes of a line that may
+ * get an entry are collected in head, which can span two writes, and the
+ * decision is made once the head is complete or the line ends.
+ */
+struct line_index {
+    int fd;
+    long long every;            /* entry every N lines, 0 if off */
+    long long bucket;           /* entry per bucket of this many seconds */
+    uint64_t line;              /* number of the line being written */
+    int in_line;                /* the next byte continues a line */
+    int collecting;             /* head is being filled */
+    char head[LINEIDX_HEAD];
+    size_t head_len;
+    uint64_t head_line;
+    off_t head_off;
+    int64_t last_bucket;
+    struct lineidx_entry pending[IDX_BATCH];
+    int npending;
+};
+
+/* --route: lines containing pattern are also written to fd. */
+struct route {
+    const char *pattern;
+    size_t plen;
+    int fd;
+    char *carry;                /* a line split across reads, with its prefix */
+    size_t carry_len, carry_cap;
+    size_t carry_skip;          /* length of that prefix */
+    struct iovec out[IOV_MAX];
+    int nout;
+};
+
+/*
+ * Per-line processing between stdin and the outputs.  Lines are located
+ * with nl_scan() and passed on as iovecs pointing into the read buffer,
+ * with a shared timestamp prefix spliced in front where requested, so no
+ * line is ever copied on the main path.
+ */
+struct line_stage {
+    int timestamp;              /* prefix lines with the time they were read */
+    int count;                  /* report the number of lines on exit */
+    uint64_t lines;
+    int in_line;                /* the next byte continues a line */
+    char prefix[40];
+    size_t prefix_len;
+    struct iovec out[IOV_MAX];
+    int nout;
+    struct route routes[MAX_ROUTES];
+    int nroutes;
+};
+
+/* The output file together with the bookkeeping for its sync policy. */
+struct sink {
+    const char *path;
+    int direct;                 /* open segments with O_DIRECT */
+    int fd;
+    off_t pos;                  /* file offset of the next byte written */
+    off_t kicked;               /* writeback has been started up to here */
+    off_t synced;               /* fdatasync() has covered up to here */
+    struct sync_policy sync;
+    off_t window;               /* --stream window size, 0 if not streaming */
+    off_t win_start;            /* start of the window currently being filled */
+    off_t drop_from;            /* cache before this offset has been dropped */
+    struct dio *dio;            /* non-NULL when writing with O_DIRECT */
+    off_t prealloc;             /* --prealloc chunk size, 0 if disabled */
+    off_t alloc_end;            /* blocks are reserved up to here */
+    off_t map_size;             /* --mmap window size, 0 if not mapping */
+    char *map;                  /* current window, NULL if none */
+    off_t map_off;              /* file offset of map[0] */
+
+    off_t rotate_size;          /* rotate once the file reaches this size */
+    long long rotate_ms;        /* rotate once the segment is this old */
+    struct timespec opened;     /* when the current segment was started */
+    int next_fd;                /* pre-created next segment, -1 if none */
+    unsigned seq;               /* suffix of the last rotated segment */
+    struct compressor *zq;      /* non-NULL with --rotate-compress */
+    struct framer *fr;          /* non-NULL with --frame */
+    struct line_index *idx;     /* non-NULL with --index or --index-time */
+    struct lz *lz;              /* non-NULL with --compress */
+};
+
+/*
+ * Counters for one side of the copy, kept for the SIGUSR1 report.  The
+ * file may be written by the O_DIRECT or LZ4 worker while the main thread
+ * reports, hence the atomics.
+ */
+struct io_side {
+    atomic_ullong bytes;
+    atomic_ullong calls;        /* read/write system calls made */
+    atomic_ullong short_writes;
+    atomic_llong blocked_ns;    /* total time spent inside those calls */
+    atomic_llong since;         /* start of the call in progress, 0 if none */
+};
+
+/*
+ * Parallel outputs, used when append writes to several files.  The main
+ * thread reads stdin into chunks, and every output (stdout and each file)
+ * has its own writer thread that works through the chunks in order, so a
+ * slow device only holds up its own output.  Chunks are shared, never
+ * copied: each carries a count of the writers still to write it and goes
+ * back to the free list when that reaches zero.  There are only so many
+ * chunks, which bounds both memory and how far an output can lag.
+ */
+struct chunk {
+    struct chunk *next;         /* free list */
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct output {
+    struct tee *tee;
+    struct sink *sink;          /* NULL for stdout */
+    int cpu;                    /* CPU to pin the writer to, -1 if none */
+    pthread_t thread;
+    unsigned long long next;    /* sequence number of the next chunk */
+    unsigned long long done;    /* bytes written */
+};
+
+struct tee {
+    pthread_mutex_t mtx;
+    pthread_cond_t data;        /* writers wait here for chunks */
+    pthread_cond_t space;       /* the reader waits here for a free chunk */
+    struct chunk **ring;        /* chunk with sequence number n is ring[n % nchunks] */
+    int nchunks;
+    struct chunk *free;
+    unsigned long long head;    /* sequence number of the next chunk read */
+    unsigned long long read;    /* bytes read */
+    int eof;
+    struct output out[MAX_FILES + 1];
+    int nout;
+};
+
+/*
+ * Data stdout could not take yet.  With --nonblock stdout is switched to
+ * O_NONBLOCK and whatever a write leaves over is queued here, so the file
+ * keeps getting everything as it arrives while a slow or stopped consumer
+ * only grows the backlog.  Once it reaches its limit stdin is no longer
+ * read, which pushes back on the producer instead.
+ */
+struct backlog {
+    char *buf;
+    size_t head, len, cap;
+    size_t limit;
+    int saved_flags;            /* stdout's status flags before we changed them */
+};
+
+/*
+ * Live subscribers (--tap).  Everything sent to stdout is also copied into
+ * a ring of recent data, and a thread serves the clients of a Unix stream
+ * socket from it, each at its own position.  Writes to clients never
+ * block.  A client that falls a whole ring behind is skipped ahead to the
+ * live position, so a slow subscriber loses data but never holds up stdout
+ * or the file.
+ */
+struct tap_client {
+    struct tap_client *next;
+    int fd;                     /* -1 once it has gone away */
+    unsigned long long pos;     /* stream offset of the next byte to send */
+    int blocked;                /* socket full, waiting for EPOLLOUT */
+};
+
+struct tap {
+    const char *path;
+    int listen_fd, ep, wake_fd;
+    char *ring;
+    struct tap_client *clients;     /* touched by the thread only */
+
+    pthread_t thread;
+    pthread_mutex_t mtx;            /* guards the fields below and ring */
+    unsigned long long head;        /* stream offset just past the newest byte */
+    int nclients;
+    int idle;                       /* thread is parked in epoll_wait */
+    int quit;
+    unsigned long long skipped;     /* bytes clients lost by falling behind */
+};
+
+static struct backlog *out_backlog;     /* non-NULL with --nonblock */
+static struct tap *out_tap;             /* non-NULL with --tap */
+static struct tee *out_tee;             /* non-NULL with several files */
+
+static struct {
+    struct io_side in, out, file;
+    long long start;
+    const struct sink *sink;
+    pthread_t main;
+} stats;
+
+extern char **environ;
+
+static volatile sig_atomic_t sync_due = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t stats_due = 0;
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-a] [-d] [-b BUFSIZE] [--sync=none|interval:MS|bytes:N|every]\n"
+                    "          [--stream[=WINDOW]] [--prealloc[=CHUNK]]\n"
+                    "          [--rotate-size=N] [--rotate-interval=T[s|m|h]]\n"
+                    "          [--rotate-compress[=CMD]] [--frame=chunk|line]\n"
+                    "          [--index=N] [--index-time=SECS]\n"
+                    "          [--timestamp] [--count] [--route=PATTERN:FILE]...\n"
+                    "          [-z|--compress] [--vmsplice] [--nonblock[=BACKLOG]]\n"
+                    "          [--mmap[=WINDOW]] [--tap=SOCKET] [--stats-interval=T]\n"
+                    "          [--max-lag=SIZE] [--cpus=LIST]\n"
+                    "          [-c [--listen=SOCKET] [--fifo=PATH]...] file [file...]\n",
+            progname);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void on_alarm(int sig) {
+    (void)sig;
+    sync_due = 1;
+}
+
+static void on_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void on_stats(int sig) {
+    (void)sig;
+    stats_due = 1;
+}
+
+/* Parse a byte count with an optional k/m/g suffix; -1 on error. */
+static long long parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || v < 0)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return *end == '\0' ? v : -1;
+}
+
+/* Parse a duration, in seconds unless suffixed with m/h; ms, -1 on error. */
+static long long parse_duration(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || v <= 0)
+        return -1;
+    switch (*end) {
+    case '\0': case 's': v *= 1000; break;
+    case 'm': v *= 60 * 1000; break;
+    case 'h': v *= 60 * 60 * 1000; break;
+    default: return -1;
+    }
+    return (*end == '\0' || end[1] == '\0') ? v : -1;
+}
+
+/* Parse a plain number of milliseconds; -1 on error (suffixes included). */
+static long long parse_ms(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v < 0)
+        return -1;
+    return v;
+}
+
+static int parse_sync(const char *s, struct sync_policy *p) {
+    if (strcmp(s, "none") == 0) {
+        p->mode = SYNC_NONE;
+    } else if (strcmp(s, "every") == 0) {
+        p->mode = SYNC_EVERY;
+    } else if (strncmp(s, "interval:", 9) == 0) {
+        p->mode = SYNC_INTERVAL;
+        p->arg = parse_ms(s + 9);
+    } else if (strncmp(s, "bytes:", 6) == 0) {
+        p->mode = SYNC_BYTES;
+        p->arg = parse_size(s + 6);
+    } else {
+        return -1;
+    }
+    if ((p->mode == SYNC_INTERVAL || p->mode == SYNC_BYTES) && p->arg <= 0)
+        return -1;
+    return 0;
+}
+
+/* ---- I/O statistics ----------------------------------------------------- */
+
+static long long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Bracket one system call on side io (which may be NULL).  A wait that is
+   retried after EINTR keeps its original start time. */
+static long long io_begin(struct io_side *io) {
+    if (!io)
+        return 0;
+    long long t = clock_ns();
+    if (!atomic_load_explicit(&io->since, memory_order_relaxed))
+        atomic_store_explicit(&io->since, t, memory_order_relaxed);
+    return t;
+}
+
+/* n is the call's result, want the length asked for; 0 for reads, where a
+   short count is not worth reporting. */
+static void io_end(struct io_side *io, long long t0, ssize_t n, size_t want) {
+    if (!io)
+        return;
+    if (n >= 0 || errno != EINTR)
+        atomic_store_explicit(&io->since, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&io->blocked_ns, clock_ns() - t0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&io->calls, 1, memory_order_relaxed);
+    if (n > 0)
+        atomic_fetch_add_explicit(&io->bytes, (unsigned long long)n,
+                                  memory_order_relaxed);
+    if (n >= 0 && (size_t)n < want)
+        atomic_fetch_add_explicit(&io->short_writes, 1, memory_order_relaxed);
+}
+
+static ssize_t io_read(int fd, void *buf, size_t len, struct io_side *io) {
+    long long t0 = io_begin(io);
+    ssize_t n = read(fd, buf, len);
+    io_end(io, t0, n, 0);
+    return n;
+}
+
+static void stats_side(const char *name, struct io_side *io, int fd, long long now) {
+    long long since = atomic_load_explicit(&io->since, memory_order_relaxed);
+    fprintf(stderr, "  %-6s %14llu bytes %10llu calls %8llu short %9.3f s blocked",
+            name, (unsigned long long)atomic_load(&io->bytes),
+            (unsigned long long)atomic_load(&io->calls),
+            (unsigned long long)atomic_load(&io->short_writes),
+            atomic_load(&io->blocked_ns) / 1e9);
+    if (since)
+        fprintf(stderr, ", in a call for %.3f s", (now - since) / 1e9);
+    struct stat st;
+    int queued;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+        ioctl(fd, FIONREAD, &queued) == 0)
+        fprintf(stderr, ", %d bytes in pipe", queued);
+    fputc('\n', stderr);
+}
+
+static void tap_report(struct tap *t);
+static void tee_report(struct tee *t);
+
+/*
+ * Print the counters to stderr.  Runs on the main thread in normal context;
+ * the signal handler only sets stats_due.  Comparing blocked times shows
+ * which side holds the pipeline back: a stdout that is always in a call
+ * with a full pipe is a slow consumer, a stdin that is always in a call is
+ * a slow producer.
+ */
+static void stats_report(void) {
+    const struct sink *s = stats.sink;
+    long long now = clock_ns();
+    size_t staged = 0;
+    if (s && s->dio)
+        staged += s->dio->fill;
+    if (s && s->lz)
+        staged += s->lz->fill;
+    fprintf(stderr, "append: %.3f s, %zu bytes staged for the file",
+            (now - stats.start) / 1e9, staged);
+    if (out_backlog)
+        fprintf(stderr, ", %zu bytes backlog for stdout", out_backlog->len);
+    fputc('\n', stderr);
+    stats_side("stdin", &stats.in, STDIN_FILENO, now);
+    stats_side("stdout", &stats.out, STDOUT_FILENO, now);
+    stats_side("file", &stats.file, -1, now);
+    if (out_tee)
+        tee_report(out_tee);
+    if (out_tap)
+        tap_report(out_tap);
+}
+
+/* Report if one was asked for; cheap enough to call on every iteration. */
+static void stats_poll(void) {
+    if (stats_due && pthread_equal(pthread_self(), stats.main)) {
+        stats_due = 0;
+        stats_report();
+    }
+}
+
+/* Deliver SIGUSR1 every ms milliseconds. */
+static void start_stats_timer(long long ms) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGUSR1;
+    timer_t t;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &t) < 0)
+        die("timer_create");
+    struct itimerspec its;
+    its.it_interval.tv_sec = ms / 1000;
+    its.it_interval.tv_nsec = (ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    if (timer_settime(t, 0, &its, NULL) < 0)
+        die("timer_settime");
+}
+
+/* Write all of buf, retrying short writes and signal interruptions. */
+static int write_all(int fd, const char *buf, size_t len, struct io_side *io) {
+    while (len > 0) {
+        long long t0 = io_begin(io);
+        ssize_t nw = write(fd, buf, len);
+        io_end(io, t0, nw, len);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                stats_poll();
+                continue;
+            }
+            return -1;
+        }
+        buf += nw;
+        len -= (size_t)nw;
+    }
+    return 0;
+}
+
+/* Like write_all() for a gather list of at most IOV_MAX entries. */
+static int writev_all(int fd, const struct iovec *iov, int cnt, struct io_side *io) {
+    struct iovec v[IOV_MAX];
+    memcpy(v, iov, cnt * sizeof(*iov));
+    struct iovec *p = v;
+    size_t want = 0;
+    if (io)
+        for (int i = 0; i < cnt; i++)
+            want += iov[i].iov_len;
+    while (cnt > 0) {
+        long long t0 = io_begin(io);
+        ssize_t nw = writev(fd, p, cnt);
+        io_end(io, t0, nw, want);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                stats_poll();
+                continue;
+            }
+            return -1;
+        }
+        want -= (size_t)nw;
+        while (cnt > 0 && (size_t)nw >= p->iov_len) {
+            nw -= (ssize_t)p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char *)p->iov_base + nw;
+            p->iov_len -= (size_t)nw;
+        }
+    }
+    return 0;
+}
+
+/* ---- sink --------------------------------------------------------------- */
+
+static int dio_sync(struct sink *s);
+
+/* Wait for everything written so far to reach stable storage. */
+static int sink_sync(struct sink *s) {
+    if (s->dio)
+        return dio_sync(s);
+    if (s->synced == s->pos)
+        return 0;
+    if (fdatasync(s->fd) < 0)
+        return -1;
+    s->kicked = s->synced = s->pos;
+    return 0;
+}
+
+/*
+ * Called after every write.  Dirty data is handed to the device early with
+ * sync_file_range(SYNC_FILE_RANGE_WRITE) so that the fdatasync() which ends
+ * a sync period mostly waits for I/O that is already in flight, instead of
+ * starting all of it at once.
+ */
+static int sink_apply_policy(struct sink *s) {
+    switch (s->sync.mode) {
+    case SYNC_NONE:
+        return 0;
+    case SYNC_EVERY:
+        return sink_sync(s);
+    case SYNC_BYTES:
+        if ((s->dio ? s->dio->base + (off_t)s->dio->fill : s->pos) - s->synced >=
+            s->sync.arg)
+            return sink_sync(s);
+        break;
+    case SYNC_INTERVAL:
+        if (sync_due) {
+            sync_due = 0;
+            return sink_sync(s);
+        }
+        break;
+    }
+    if (!s->dio && s->pos - s->kicked >= SYNC_KICK) {
+        if (sync_file_range(s->fd, s->kicked, s->pos - s->kicked,
+                            SYNC_FILE_RANGE_WRITE) < 0)
+            return -1;
+        s->kicked = s->pos;
+    }
+    return 0;
+}
+
+/* Write back [from, to) synchronously and evict it from the page cache. */
+static int sink_drop_range(struct sink *s, off_t from, off_t to) {
+    if (to <= from)
+        return 0;
+    if (sync_file_range(s->fd, from, to - from,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+        return -1;
+    int err = posix_fadvise(s->fd, from, to - from, POSIX_FADV_DONTNEED);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    s->drop_from = to;
+    return 0;
+}
+
+/*
+ * Streaming (drop-behind) mode.  Each time a window fills up, writeback of
+ * that window is started and the window before it, whose writeback has had
+ * a full window's worth of time to finish, is waited on and dropped from the
+ * page cache.  At most two windows of the log are ever resident.
+ */
+static int sink_stream(struct sink *s) {
+    while (s->pos - s->win_start >= s->window) {
+        off_t done = s->win_start + s->window;
+        if (sync_file_range(s->fd, s->win_start, s->window,
+                            SYNC_FILE_RANGE_WRITE) < 0)
+            return -1;
+        if (sink_drop_range(s, s->drop_from, s->win_start) < 0)
+            return -1;
+        s->win_start = done;
+    }
+    return 0;
+}
+
+/* ---- O_DIRECT writer ---------------------------------------------------- */
+
+static void *dio_thread(void *arg) {
+    struct sink *s = arg;
+    struct dio *d = s->dio;
+
+    pthread_mutex_lock(&d->mtx);
+    for (;;) {
+        while (!d->job && !d->quit)
+            pthread_cond_wait(&d->cond, &d->mtx);
+        if (!d->job)
+            break;
+        const char *p = d->job;
+        size_t len = d->job_len;
+        off_t off = d->job_off;
+        pthread_mutex_unlock(&d->mtx);
+
+        int err = 0;
+        while (len > 0) {
+            long long t0 = io_begin(&stats.file);
+            ssize_t nw = pwrite(s->fd, p, len, off);
+            io_end(&stats.file, t0, nw, len);
+            if (nw < 0) {
+                if (errno == EINTR)
+                    continue;
+                err = errno;
+                break;
+            }
+            p += nw;
+            off += nw;
+            len -= (size_t)nw;
+        }
+
+        pthread_mutex_lock(&d->mtx);
+        if (err && !d->err)
+            d->err = err;
+        d->job = NULL;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return NULL;
+}
+
+/* Wait for the writer to go idle; everything submitted so far is on disk. */
+static int dio_wait(struct sink *s) {
+    struct dio *d = s->dio;
+    pthread_mutex_lock(&d->mtx);
+    while (d->job)
+        pthread_cond_wait(&d->cond, &d->mtx);
+    int err = d->err;
+    pthread_mutex_unlock(&d->mtx);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand the current staging buffer to the writer and switch to the other. */
+static int dio_submit(struct sink *s, size_t len) {
+    struct dio *d = s->dio;
+    if (dio_wait(s) < 0)
+        return -1;
+    if (d->base > s->pos)
+        s->pos = d->base;       /* the previous buffer is now complete */
+
+    pthread_mutex_lock(&d->mtx);
+    d->job = d->buf[d->cur];
+    d->job_len = len;
+    d->job_off = d->base;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->mtx);
+
+    d->base += (off_t)len;
+    d->cur ^= 1;
+    d->fill = 0;
+    return 0;
+}
+
+/* Set up O_DIRECT writing of a new, empty segment. */
+static int dio_start(struct sink *s) {
+    struct dio *d = calloc(1, sizeof(*d));
+    if (!d)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        int err = posix_memalign((void **)&d->buf[i], DIO_ALIGN, DIO_BUF);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+    }
+    d->base = s->pos;
+    pthread_mutex_init(&d->mtx, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    s->dio = d;
+    int err = pthread_create(&d->thread, NULL, dio_thread, s);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int dio_write(struct sink *s, const char *buf, size_t len) {
+    struct dio *d = s->dio;
+    while (len > 0) {
+        size_t n = DIO_BUF - d->fill;
+        if (n > len)
+            n = len;
+        memcpy(d->buf[d->cur] + d->fill, buf, n);
+        d->fill += n;
+        buf += n;
+        len -= n;
+        if (d->fill == DIO_BUF && dio_submit(s, DIO_BUF) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make everything staged so far durable.  The current buffer is written as
+ * it stands, its tail zero-padded to a block and cut back with ftruncate()
+ * as in dio_finish(), but it stays current: more data is added to it and
+ * it is rewritten in full when it fills up.
+ */
+static int dio_sync(struct sink *s) {
+    struct dio *d = s->dio;
+    off_t end = d->base + (off_t)d->fill;
+
+    if (end == s->synced)
+        return 0;
+    if (dio_wait(s) < 0)
+        return -1;
+    if (d->fill > 0) {
+        size_t padded = (d->fill + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+        const char *p = d->buf[d->cur];
+        off_t off = d->base;
+        memset(d->buf[d->cur] + d->fill, 0, padded - d->fill);
+        while (padded > 0) {
+            long long t0 = io_begin(&stats.file);
+            ssize_t nw = pwrite(s->fd, p, padded, off);
+            io_end(&stats.file, t0, nw, padded);
+            if (nw < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            p += nw;
+            off += nw;
+            padded -= (size_t)nw;
+        }
+        if (ftruncate(s->fd, end) < 0)
+            return -1;
+        /* The truncation also freed any blocks reserved past the end */
+        if (s->alloc_end > end)
+            s->alloc_end = end;
+    }
+    if (fdatasync(s->fd) < 0)
+        return -1;
+    if (end > s->pos)
+        s->pos = end;
+    s->kicked = s->synced = end;
+    return 0;
+}
+
+/*
+ * Flush the unaligned tail: it is written zero-padded up to the next block
+ * boundary, and the padding is then cut off again with ftruncate().
+ */
+static int dio_finish(struct sink *s) {
+    struct dio *d = s->dio;
+    off_t end = d->base + (off_t)d->fill;
+
+    if (d->fill > 0) {
+        size_t padded = (d->fill + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+        memset(d->buf[d->cur] + d->fill, 0, padded - d->fill);
+        if (dio_submit(s, padded) < 0)
+            return -1;
+    }
+    if (dio_wait(s) < 0)
+        return -1;
+    if (ftruncate(s->fd, end) < 0)
+        return -1;
+    s->pos = end;
+
+    pthread_mutex_lock(&d->mtx);
+    d->quit = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->mtx);
+    pthread_join(d->thread, NULL);
+    free(d->buf[0]);
+    free(d->buf[1]);
+    free(d);
+    s->dio = NULL;
+    return 0;
+}
+
+/* ---- line index --------------------------------------------------------- */
+
+static int idx_flush(struct line_index *ix) {
+    if (ix->npending == 0)
+        return 0;
+    if (write_all(ix->fd, (const char *)ix->pending,
+                  ix->npending * sizeof(ix->pending[0]), NULL) < 0)
+        return -1;
+    ix->npending = 0;
+    return 0;
+}
+
+/* The head of a line is complete: give it an entry if it deserves one. */
+static int idx_decide(struct line_index *ix) {
+    int64_t t = lineidx_parse_time(ix->head, ix->head_len);
+    int want = ix->every && ix->head_line % ix->every == 0;
+
+    ix->collecting = 0;
+    if (ix->bucket && t != LINEIDX_NO_TIME && t / ix->bucket != ix->last_bucket) {
+        ix->last_bucket = t / ix->bucket;
+        want = 1;
+    }
+    if (!want)
+        return 0;
+    struct lineidx_entry *e = &ix->pending[ix->npending++];
+    e->line = ix->head_line;
+    e->offset = (uint64_t)ix->head_off;
+    e->time = t;
+    return ix->npending == IDX_BATCH ? idx_flush(ix) : 0;
+}
+
+/* Account for n bytes that will land at file offset base. */
+static int idx_scan(struct line_index *ix, const char *p, size_t n, off_t base) {
+    size_t i = 0;
+    while (i < n) {
+        if (!ix->in_line) {
+            ix->in_line = 1;
+            ix->head_line = ix->line;
+            ix->head_off = base + (off_t)i;
+            ix->head_len = 0;
+            ix->collecting = ix->bucket || (ix->every && ix->line % ix->every == 0);
+        }
+        if (ix->collecting) {
+            size_t k = LINEIDX_HEAD - ix->head_len;
+            if (k > n - i)
+                k = n - i;
+            const char *nl = memchr(p + i, '\n', k);
+            if (nl)
+                k = (size_t)(nl - (p + i));
+            memcpy(ix->head + ix->head_len, p + i, k);
+            ix->head_len += k;
+            if ((nl || ix->head_len == LINEIDX_HEAD) && idx_decide(ix) < 0)
+                return -1;
+        }
+        const char *nl = memchr(p + i, '\n', n - i);
+        if (!nl)
+            break;
+        i = (size_t)(nl - p) + 1;
+        ix->in_line = 0;
+        ix->line++;
+    }
+    return 0;
+}
+
+/*
+ * Open path.idx.  When appending, pick up the line count where the index
+ * left off by counting the newlines after its last entry.
+ */
+static int idx_open(struct line_index *ix, const char *path, int append) {
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s.idx", path);
+    ix->fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (append ? 0 : O_TRUNC),
+                  0644);
+    if (ix->fd < 0)
+        return -1;
+    ix->line = 0;
+    ix->in_line = ix->collecting = 0;
+    ix->npending = 0;
+    ix->last_bucket = INT64_MIN;
+    if (!append)
+        return 0;
+
+    struct stat st;
+    if (fstat(ix->fd, &st) < 0)
+        return -1;
+    off_t n = st.st_size / (off_t)sizeof(struct lineidx_entry);
+    off_t from = 0;
+    struct lineidx_entry last;
+    if (n > 0 && pread(ix->fd, &last, sizeof(last), (n - 1) * sizeof(last)) ==
+                 (ssize_t)sizeof(last)) {
+        ix->line = last.line;
+        from = (off_t)last.offset;
+        if (ix->bucket && last.time != LINEIDX_NO_TIME)
+            ix->last_bucket = last.time / ix->bucket;
+    }
+    if (ftruncate(ix->fd, n * (off_t)sizeof(last)) < 0)   /* drop a torn entry */
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    char buf[65536];
+    ssize_t nr;
+    while ((nr = pread(fd, buf, sizeof(buf), from)) > 0) {
+        for (char *q = buf; (q = memchr(q, '\n', buf + nr - q)); q++)
+            ix->line++;
+        ix->in_line = buf[nr - 1] != '\n';
+        from += nr;
+    }
+    close(fd);
+    return nr < 0 ? -1 : 0;
+}
+
+/* ---- sink write path ---------------------------------------------------- */
+
+/*
+ * Reserve blocks ahead of the write position, one large chunk at a time, so
+ * the file system can hand out long contiguous extents instead of growing
+ * the file block by block.  FALLOC_FL_KEEP_SIZE leaves st_size alone, so
+ * readers never see the reserved space.  If the file system cannot do it,
+ * preallocation is quietly switched off.
+ */
+static int sink_reserve(struct sink *s, off_t end) {
+    while (end > s->alloc_end) {
+        if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->alloc_end, s->prealloc) < 0) {
+            if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                s->prealloc = 0;
+                return 0;
+            }
+            return -1;
+        }
+        s->alloc_end += s->prealloc;
+    }
+    return 0;
+}
+
+/*
+ * Give back blocks reserved past the end of the data.  Only ftruncate()
+ * frees blocks past EOF (ext4 ignores a hole punched there), which is why
+ * main() refuses --prealloc for a file that others may append to.
+ */
+static int sink_trim(struct sink *s) {
+    if (s->alloc_end <= s->pos)
+        return 0;
+    if (ftruncate(s->fd, s->pos) < 0)
+        return -1;
+    s->alloc_end = s->pos;
+    return 0;
+}
+
+/* Logical end of the file, including data still staged for O_DIRECT. */
+static off_t sink_end(const struct sink *s) {
+    return s->dio ? s->dio->base + (off_t)s->dio->fill : s->pos;
+}
+
+/* ---- memory-mapped output ---------------------------------------------- */
+
+/* Retire the current window: queue its pages for writeback and unmap it. */
+static int map_release(struct sink *s) {
+    if (!s->map)
+        return 0;
+    int rc = msync(s->map, s->map_size, MS_ASYNC);
+    if (munmap(s->map, s->map_size) < 0)
+        rc = -1;
+    s->map = NULL;
+    return rc;
+}
+
+/*
+ * Return where the byte at file offset off goes and how much room the
+ * window has from there, moving to the next window when the current one is
+ * used up.  The file is grown a window at a time with real blocks where the
+ * filesystem supports it, so a full disk is an error here rather than
+ * SIGBUS on a store; sink_trim() cuts it back to the data on close.
+ */
+static char *map_space(struct sink *s, off_t off, size_t *avail) {
+    if (s->map && (off < s->map_off || off >= s->map_off + s->map_size) &&
+        map_release(s) < 0)
+        return NULL;
+    if (!s->map) {
+        off_t start = off - off % s->map_size;
+        off_t end = start + s->map_size;
+        if (end > s->alloc_end) {
+            if (fallocate(s->fd, 0, s->alloc_end, end - s->alloc_end) < 0 &&
+                ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(s->fd, end) < 0))
+                return NULL;
+            s->alloc_end = end;
+        }
+        void *m = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       s->fd, start);
+        if (m == MAP_FAILED)
+            return NULL;
+#ifdef MADV_POPULATE_WRITE
+        /* Fault the whole window in writable at once instead of a page
+           fault per page on first store; older kernels just say EINVAL */
+        madvise(m, s->map_size, MADV_POPULATE_WRITE);
+#endif
+        s->map = m;
+        s->map_off = start;
+    }
+    *avail = (size_t)(s->map_off + s->map_size - off);
+    return s->map + (off - s->map_off);
+}
+
+/* Copy a gather list into the mapping at s->pos. */
+static int map_writev(struct sink *s, const struct iovec *iov, int cnt) {
+    off_t off = s->pos;
+    for (int i = 0; i < cnt; i++) {
+        const char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            size_t avail;
+            char *dst = map_space(s, off, &avail);
+            if (!dst)
+                return -1;
+            if (avail > len)
+                avail = len;
+            memcpy(dst, p, avail);
+            p += avail;
+            off += (off_t)avail;
+            len -= avail;
+        }
+    }
+    return 0;
+}
+
+static int sink_rotate(struct sink *s);
+
+static int sink_rotation_due(const struct sink *s) {
+    off_t end = sink_end(s);
+    if (end == 0)
+        return 0;               /* never rotate out an empty segment */
+    if (s->rotate_size && end >= s->rotate_size)
+        return 1;
+    if (s->rotate_ms) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long age = (now.tv_sec - s->opened.tv_sec) * 1000LL +
+                        (now.tv_nsec - s->opened.tv_nsec) / 1000000;
+        if (age >= s->rotate_ms)
+            return 1;
+    }
+    return 0;
+}
+
+/* len bytes have been written at s->pos. */
+static int sink_advance(struct sink *s, size_t len) {
+    s->pos += (off_t)len;
+    if (s->map_size)
+        atomic_fetch_add_explicit(&stats.file.bytes, len, memory_order_relaxed);
+    if (s->window && sink_stream(s) < 0)
+        return -1;
+    return sink_apply_policy(s);
+}
+
+/* Write to the current segment as is. */
+static int sink_out(struct sink *s, const struct iovec *iov, int cnt) {
+    size_t len = 0;
+    for (int i = 0; i < cnt; i++)
+        len += iov[i].iov_len;
+
+    if (s->prealloc && sink_reserve(s, sink_end(s) + (off_t)len) < 0)
+        return -1;
+    if (s->idx) {
+        off_t base = sink_end(s);
+        for (int i = 0; i < cnt; i++) {
+            if (idx_scan(s->idx, iov[i].iov_base, iov[i].iov_len, base) < 0)
+                return -1;
+            base += (off_t)iov[i].iov_len;
+        }
+    }
+    if (s->dio) {
+        for (int i = 0; i < cnt; i++)
+            if (dio_write(s, iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+        return sink_apply_policy(s);
+    }
+    if (s->map_size ? map_writev(s, iov, cnt) < 0 :
+                      writev_all(s->fd, iov, cnt, &stats.file) < 0)
+        return -1;
+    return sink_advance(s, len);
+}
+
+static int sink_store(struct sink *s, const struct iovec *iov, int cnt) {
+    if ((s->rotate_size || s->rotate_ms) && sink_rotation_due(s) &&
+        sink_rotate(s) < 0)
+        return -1;
+    return sink_out(s, iov, cnt);
+}
+
+/* ---- LZ4 compression ---------------------------------------------------- */
+
+static void *lz_thread(void *arg) {
+    struct sink *s = arg;
+    struct lz *z = s->lz;
+
+    pthread_mutex_lock(&z->mtx);
+    for (;;) {
+        while (!z->busy && !z->quit)
+            pthread_cond_wait(&z->cond, &z->mtx);
+        if (!z->busy)
+            break;
+        const unsigned char *in = z->job;
+        size_t len = z->job_len;
+        int sync = z->job_sync;
+        pthread_mutex_unlock(&z->mtx);
+
+        int rc;
+        if (len == 0) {
+            rc = sink_apply_policy(s);
+        } else {
+            /* Blocks that do not shrink are stored uncompressed */
+            unsigned char hdr[4];
+            size_t n = lz4_compress_block(in, len, z->out, z->table);
+            uint32_t word = (uint32_t)n;
+            struct iovec iov[2] = { { hdr, 4 }, { z->out, n } };
+            if (n >= len) {
+                word = (uint32_t)len | LZ4_UNCOMPRESSED;
+                iov[1].iov_base = (void *)in;
+                iov[1].iov_len = len;
+            }
+            frame_put32(hdr, word);
+            rc = sink_store(s, iov, 2);
+        }
+        if (rc == 0 && sync)
+            rc = sink_sync(s);
+
+        pthread_mutex_lock(&z->mtx);
+        if (rc < 0 && !z->err)
+            z->err = errno;
+        z->busy = 0;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->mtx);
+    return NULL;
+}
+
+/* Wait for the worker to go idle. */
+static int lz_wait(struct sink *s) {
+    struct lz *z = s->lz;
+    pthread_mutex_lock(&z->mtx);
+    while (z->busy)
+        pthread_cond_wait(&z->cond, &z->mtx);
+    int err = z->err;
+    pthread_mutex_unlock(&z->mtx);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The policy counts the data we were given, not what it compresses to, so
+ * --sync=every and bytes:N are judged here and the worker told to sync.
+ */
+static int lz_sync_due(const struct sink *s) {
+    return s->sync.mode == SYNC_EVERY ||
+           (s->sync.mode == SYNC_BYTES && s->lz->unsynced >= s->sync.arg);
+}
+
+/* Hand the block being filled (possibly empty) to the worker. */
+static int lz_submit(struct sink *s) {
+    struct lz *z = s->lz;
+    if (lz_wait(s) < 0)
+        return -1;
+    pthread_mutex_lock(&z->mtx);
+    z->job = z->in[z->cur];
+    z->job_len = z->fill;
+    z->job_sync = lz_sync_due(s);
+    if (z->job_sync)
+        z->unsynced = 0;
+    z->busy = 1;
+    pthread_cond_signal(&z->cond);
+    pthread_mutex_unlock(&z->mtx);
+    z->cur ^= 1;
+    z->fill = 0;
+    return 0;
+}
+
+static int lz_put(struct sink *s, const struct iovec *iov, int cnt) {
+    struct lz *z = s->lz;
+    for (int i = 0; i < cnt; i++) {
+        const char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            size_t n = LZ4_BLOCK_MAX - z->fill;
+            if (n > len)
+                n = len;
+            memcpy(z->in[z->cur] + z->fill, p, n);
+            z->fill += n;
+            z->unsynced += (long long)n;
+            p += n;
+            len -= n;
+            if (z->fill == LZ4_BLOCK_MAX && lz_submit(s) < 0)
+                return -1;
+        }
+    }
+    /* A partial block that the policy wants durable cannot wait to fill */
+    if (z->fill > 0 && lz_sync_due(s))
+        return lz_submit(s);
+    return 0;
+}
+
+static int lz_frame_header(struct sink *s) {
+    unsigned char hdr[LZ4_FRAME_HDR];
+    struct iovec iov = { hdr, lz4_frame_header(hdr) };
+    return sink_out(s, &iov, 1);
+}
+
+static int lz_end_mark(struct sink *s) {
+    static unsigned char zero[LZ4_END_MARK];
+    struct iovec iov = { zero, LZ4_END_MARK };
+    return sink_out(s, &iov, 1);
+}
+
+/* Allocate the buffers, start the frame and the worker. */
+static int lz_start(struct sink *s) {
+    struct lz *z = calloc(1, sizeof(*z));
+    if (!z)
+        return -1;
+    z->in[0] = malloc(LZ4_BLOCK_MAX);
+    z->in[1] = malloc(LZ4_BLOCK_MAX);
+    z->out = malloc(lz4_bound(LZ4_BLOCK_MAX));
+    z->table = malloc(LZ4_TABLE_SIZE * sizeof(*z->table));
+    if (!z->in[0] || !z->in[1] || !z->out || !z->table)
+        return -1;
+    pthread_mutex_init(&z->mtx, NULL);
+    pthread_cond_init(&z->cond, NULL);
+    if (lz_frame_header(s) < 0)
+        return -1;
+    s->lz = z;
+    int err = pthread_create(&z->thread, NULL, lz_thread, s);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Compress what is left, stop the worker and end the frame. */
+static int lz_finish(struct sink *s) {
+    struct lz *z = s->lz;
+    if ((z->fill > 0 && lz_submit(s) < 0) || lz_wait(s) < 0)
+        return -1;
+    pthread_mutex_lock(&z->mtx);
+    z->quit = 1;
+    pthread_cond_signal(&z->cond);
+    pthread_mutex_unlock(&z->mtx);
+    pthread_join(z->thread, NULL);
+    free(z->in[0]);
+    free(z->in[1]);
+    free(z->out);
+    free(z->table);
+    free(z);
+    s->lz = NULL;
+    return lz_end_mark(s);
+}
+
+static int sink_put(struct sink *s, const struct iovec *iov, int cnt) {
+    if (s->lz)
+        return lz_put(s, iov, cnt);
+    return sink_store(s, iov, cnt);
+}
+
+/*
+ * Called when a read was interrupted by the sync timer.  With compression
+ * the file belongs to the worker, so the partial block is handed over
+ * instead and the worker applies the policy after writing it.
+ */
+static int sink_idle(struct sink *s) {
+    if (s->lz)
+        return sync_due ? lz_submit(s) : 0;
+    return sink_apply_policy(s);
+}
+
+/* ---- record framing ----------------------------------------------------- */
+
+static int frame_flush(struct sink *s) {
+    struct framer *f = s->fr;
+    int rc = f->nout ? sink_put(s, f->out, f->nout) : 0;
+    f->nout = f->nhdr = 0;
+    f->carry_busy = 0;
+    return rc;
+}
+
+/* Queue one record made of nparts pieces, at most FRAME_MAX bytes. */
+static int frame_one(struct sink *s, const struct iovec *parts, int nparts) {
+    struct framer *f = s->fr;
+    if ((f->nout + 1 + nparts > IOV_MAX || f->nhdr == IOV_MAX / 2) &&
+        frame_flush(s) < 0)
+        return -1;
+
+    unsigned char *hdr = f->hdr[f->nhdr++];
+    size_t len = 0;
+    for (int i = 0; i < nparts; i++)
+        len += parts[i].iov_len;
+    frame_put32(hdr, (uint32_t)len);
+    uint32_t crc = crc32c(0, hdr, 4);
+    for (int i = 0; i < nparts; i++)
+        crc = crc32c(crc, parts[i].iov_base, parts[i].iov_len);
+    frame_put32(hdr + 4, crc);
+
+    f->out[f->nout].iov_base = hdr;
+    f->out[f->nout++].iov_len = FRAME_HDR;
+    memcpy(&f->out[f->nout], parts, nparts * sizeof(*parts));
+    f->nout += nparts;
+    return 0;
+}
+
+/*
+ * Queue one record made of nparts pieces.  framescan takes a length over
+ * FRAME_MAX for corruption, so a longer record (a huge -b chunk, a huge
+ * line) is cut into records of FRAME_MAX.
+ */
+static int frame_record(struct sink *s, const struct iovec *parts, int nparts) {
+    size_t len = 0;
+    for (int i = 0; i < nparts; i++)
+        len += parts[i].iov_len;
+    if (len <= FRAME_MAX)
+        return frame_one(s, parts, nparts);
+
+    struct iovec *slice = malloc(nparts * sizeof(*slice));
+    if (!slice)
+        return -1;
+    int i = 0;
+    size_t off = 0;
+    while (i < nparts) {
+        int n = 0;
+        size_t room = FRAME_MAX;
+        while (i < nparts && room > 0) {
+            size_t take = parts[i].iov_len - off;
+            if (take > room)
+                take = room;
+            if (take > 0) {
+                slice[n].iov_base = (char *)parts[i].iov_base + off;
+                slice[n++].iov_len = take;
+            }
+            room -= take;
+            off += take;
+            if (off == parts[i].iov_len) {
+                i++;
+                off = 0;
+            }
+        }
+        if (n > 0 && frame_one(s, slice, n) < 0) {
+            free(slice);
+            return -1;
+        }
+    }
+    free(slice);
+    return 0;
+}
+
+/* Keep an unterminated line for the next call. */
+static int frame_hold(struct sink *s, const char *p, size_t n) {
+    struct framer *f = s->fr;
+    if (f->carry_busy && frame_flush(s) < 0)
+        return -1;
+    if (f->carry_len + n > FRAME_MAX) {
+        /* Absurdly long line: cut it into records of FRAME_MAX */
+        struct iovec part = { f->carry, f->carry_len };
+        if (frame_record(s, &part, 1) < 0 || frame_flush(s) < 0)
+            return -1;
+        f->carry_len = 0;
+    }
+    if (f->carry_len + n > f->carry_cap) {
+        size_t cap = f->carry_cap ? f->carry_cap : 4096;
+        while (cap < f->carry_len + n)
+            cap *= 2;
+        char *p2 = realloc(f->carry, cap);
+        if (!p2)
+            return -1;
+        f->carry = p2;
+        f->carry_cap = cap;
+    }
+    memcpy(f->carry + f->carry_len, p, n);
+    f->carry_len += n;
+    return 0;
+}
+
+static int frame_lines(struct sink *s, const struct iovec *iov, int cnt) {
+    struct framer *f = s->fr;
+    for (int i = 0; i < cnt; i++) {
+        char *p = iov[i].iov_base;
+        char *end = p + iov[i].iov_len;
+        while (p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            if (!nl) {
+                if (frame_hold(s, p, end - p) < 0)
+                    return -1;
+                break;
+            }
+            struct iovec parts[2];
+            int nparts = 0;
+            if (f->carry_len) {
+                parts[nparts].iov_base = f->carry;
+                parts[nparts++].iov_len = f->carry_len;
+                f->carry_len = 0;
+                f->carry_busy = 1;
+            }
+            parts[nparts].iov_base = p;
+            parts[nparts++].iov_len = nl + 1 - p;
+            if (frame_record(s, parts, nparts) < 0)
+                return -1;
+            p = nl + 1;
+        }
+    }
+    return frame_flush(s);
+}
+
+/* Emit a final unterminated line, if any, as a record of its own. */
+static int frame_finish(struct sink *s) {
+    struct framer *f = s->fr;
+    if (f->carry_len) {
+        struct iovec part = { f->carry, f->carry_len };
+        if (frame_record(s, &part, 1) < 0)
+            return -1;
+        f->carry_len = 0;
+    }
+    if (frame_flush(s) < 0)
+        return -1;
+    free(f->carry);
+    free(f);
+    s->fr = NULL;
+    return 0;
+}
+
+/*
+ * Everything bound for the file goes through here.  Unframed data is
+ * written as is; in chunk mode each call becomes one record, and in line
+ * mode each newline-terminated line does.
+ */
+static int sink_writev(struct sink *s, const struct iovec *iov, int cnt) {
+    if (!s->fr)
+        return sink_put(s, iov, cnt);
+    if (s->fr->mode == FRAME_LINE)
+        return frame_lines(s, iov, cnt);
+    return frame_record(s, iov, cnt) < 0 ? -1 : frame_flush(s);
+}
+
+static int sink_write(struct sink *s, const char *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return sink_writev(s, &iov, 1);
+}
+
+/* ---- segments and rotation --------------------------------------------- */
+
+static int sink_flags(const struct sink *s, int append) {
+    /* O_DIRECT writes go to explicit offsets, so O_APPEND cannot be used;
+       main() refuses -a with -d. */
+    if (s->direct)
+        return O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT | O_TRUNC;
+    /* Likewise for a mapping, which needs read access too; main() refuses
+       -a with --mmap. */
+    if (s->map_size)
+        return O_RDWR | O_CREAT | O_CLOEXEC | O_TRUNC;
+    return O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+}
+
+/* Start writing a segment on an already open fd. */
+static int sink_attach(struct sink *s, int fd, int append) {
+    s->fd = fd;
+    s->pos = 0;
+    if (append) {
+        s->pos = lseek(fd, 0, SEEK_END);
+        if (s->pos < 0)
+            return -1;
+    }
+    s->kicked = s->synced = s->alloc_end = s->pos;
+    /* Keep windows aligned so whole pages are dropped */
+    if (s->window)
+        s->win_start = s->drop_from = s->pos - s->pos % s->window;
+    clock_gettime(CLOCK_MONOTONIC, &s->opened);
+    if (s->direct && dio_start(s) < 0)
+        return -1;
+    return 0;
+}
+
+/* Finish the current segment: flush, trim, sync and close it. */
+static int sink_close(struct sink *s) {
+    int fd = s->fd;
+    if (s->idx && idx_flush(s->idx) < 0) {
+        perror("write index");
+        close(fd);
+        return -1;
+    }
+    if (s->dio && dio_finish(s) < 0) {
+        perror("write to file");
+        close(fd);
+        return -1;
+    }
+    if (map_release(s) < 0) {
+        perror("munmap");
+        close(fd);
+        return -1;
+    }
+    if (sink_trim(s) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    /* Any policy other than none leaves the file fully durable */
+    if (s->sync.mode != SYNC_NONE && sink_sync(s) < 0) {
+        perror("fdatasync");
+        close(fd);
+        return -1;
+    }
+    if (s->window && sink_drop_range(s, s->drop_from, s->pos) < 0) {
+        perror("drop page cache");
+        close(fd);
+        return -1;
+    }
+    s->fd = -1;
+    if (close(fd) < 0) {
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
+
+static void next_path(const struct sink *s, char *buf, size_t size) {
+    snprintf(buf, size, "%s.next", s->path);
+}
+
+/*
+ * Create (and reserve space for) the segment that the next rotation will
+ * switch to, so that the rotation itself only has to rename files.
+ */
+static int sink_prepare_next(struct sink *s) {
+    char path[PATH_MAX];
+    next_path(s, path, sizeof(path));
+    s->next_fd = open(path, sink_flags(s, 0), 0644);
+    if (s->next_fd < 0)
+        return -1;
+    if (s->prealloc &&
+        fallocate(s->next_fd, FALLOC_FL_KEEP_SIZE, 0, s->prealloc) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+        return -1;
+    return 0;
+}
+
+static void *compress_thread(void *arg) {
+    struct compressor *z = arg;
+
+    pthread_mutex_lock(&z->mtx);
+    for (;;) {
+        while (!z->head && !z->quit)
+            pthread_cond_wait(&z->cond, &z->mtx);
+        struct zjob *job = z->head;
+        if (!job)
+            break;
+        z->head = job->next;
+        if (!z->head)
+            z->tail = &z->head;
+        pthread_mutex_unlock(&z->mtx);
+
+        char script[PATH_MAX];
+        snprintf(script, sizeof(script), "%s \"$1\"", z->cmd);
+        char *args[] = { "sh", "-c", script, "sh", job->path, NULL };
+        pid_t pid;
+        int status;
+        int err = posix_spawn(&pid, "/bin/sh", NULL, NULL, args, environ);
+        pid_t w = -1;
+        while (!err && (w = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+            ;
+        if (err || w < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "append: '%s' failed on %s\n", z->cmd, job->path);
+        free(job);
+
+        pthread_mutex_lock(&z->mtx);
+    }
+    pthread_mutex_unlock(&z->mtx);
+    return NULL;
+}
+
+static struct compressor *compressor_start(const char *cmd) {
+    struct compressor *z = calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+    z->cmd = cmd;
+    z->tail = &z->head;
+    pthread_mutex_init(&z->mtx, NULL);
+    pthread_cond_init(&z->cond, NULL);
+    int err = pthread_create(&z->thread, NULL, compress_thread, z);
+    if (err) {
+        errno = err;
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static int compressor_add(struct compressor *z, const char *path) {
+    struct zjob *job = malloc(sizeof(*job) + strlen(path) + 1);
+    if (!job)
+        return -1;
+    job->next = NULL;
+    strcpy(job->path, path);
+    pthread_mutex_lock(&z->mtx);
+    *z->tail = job;
+    z->tail = &job->next;
+    pthread_cond_signal(&z->cond);
+    pthread_mutex_unlock(&z->mtx);
+    return 0;
+}
+
+/* Let the compressor work through its queue, then stop it. */
+static void compressor_finish(struct compressor *z) {
+    pthread_mutex_lock(&z->mtx);
+    z->quit = 1;
+    pthread_cond_signal(&z->cond);
+    pthread_mutex_unlock(&z->mtx);
+    pthread_join(z->thread, NULL);
+    free(z);
+}
+
+/*
+ * Highest N for which file.N, or anything made from it such as file.N.gz or
+ * file.N.zst, is in the directory.  --rotate-compress runs an arbitrary
+ * command, so its output name cannot be predicted; any file.N.* counts.
+ */
+static unsigned last_segment(const char *path) {
+    char dir[PATH_MAX], base[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(base, sizeof(base), "%s", path);
+    const char *name = basename(base);
+    size_t len = strlen(name);
+
+    DIR *d = opendir(dirname(dir));
+    if (!d)
+        return 0;
+    unsigned last = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, name, len) != 0 || e->d_name[len] != '.' ||
+            !isdigit((unsigned char)e->d_name[len + 1]))
+            continue;
+        char *end;
+        unsigned long n = strtoul(e->d_name + len + 1, &end, 10);
+        if ((*end == '\0' || *end == '.') && n > last && n <= UINT_MAX)
+            last = (unsigned)n;
+    }
+    closedir(d);
+    return last;
+}
+
+/*
+ * Rotation happens between two chunks.  The finished segment keeps its data
+ * under a numbered name (file.1, file.2, ...) and the pre-created file.next
+ * is renamed over file in one atomic step, so a reader opening file always
+ * finds one.
+ */
+static int sink_rotate(struct sink *s) {
+    char seg[PATH_MAX], next[PATH_MAX];
+
+    /* Each compressed segment is a complete LZ4 frame */
+    if (s->lz && lz_end_mark(s) < 0)
+        return -1;
+    if (sink_close(s) < 0)
+        return -1;
+    /* Numbering carries on after the segments of earlier runs */
+    if (s->seq == 0)
+        s->seq = last_segment(s->path);
+    do {
+        s->seq++;
+        snprintf(seg, sizeof(seg), "%s.%u", s->path, s->seq);
+    } while (access(seg, F_OK) == 0);
+
+    next_path(s, next, sizeof(next));
+    if (link(s->path, seg) < 0 && rename(s->path, seg) < 0)
+        return -1;
+    if (s->idx) {
+        /* The index describes the segment, so it moves along with it */
+        char from[PATH_MAX], to[PATH_MAX + 8];
+        snprintf(from, sizeof(from), "%s.idx", s->path);
+        snprintf(to, sizeof(to), "%s.idx", seg);
+        close(s->idx->fd);
+        if (rename(from, to) < 0 || idx_open(s->idx, s->path, 0) < 0)
+            return -1;
+    }
+    if (rename(next, s->path) < 0)
+        return -1;
+    if (sink_attach(s, s->next_fd, 0) < 0)
+        return -1;
+    if (s->lz && lz_frame_header(s) < 0)
+        return -1;
+    if (sink_prepare_next(s) < 0)
+        return -1;
+    if (s->zq && compressor_add(s->zq, seg) < 0)
+        return -1;
+    return 0;
+}
+
+/* ---- subscribers ------------------------------------------------------- */
+
+static int open_listener(const char *path);
+
+/*
+ * Send a client what it has not seen yet, one sendmsg() per call.  The
+ * mutex is held across it so the ring cannot be overwritten under the
+ * kernel's copy; with MSG_DONTWAIT that is never longer than one copy into
+ * the socket buffer.  Returns 1 if more could be sent, 0 if the client is
+ * caught up or its socket is full, -1 if it has gone away.
+ */
+static int tap_send(struct tap *t, struct tap_client *c) {
+    pthread_mutex_lock(&t->mtx);
+    if (t->head - c->pos > TAP_RING) {
+        t->skipped += t->head - c->pos;
+        c->pos = t->head;
+    }
+    size_t len = (size_t)(t->head - c->pos);
+    size_t off = (size_t)(c->pos % TAP_RING);
+    int rc = 0;
+    if (len > 0) {
+        struct iovec iov[2] = { { t->ring + off, len } };
+        int cnt = 1;
+        if (len > TAP_RING - off) {
+            iov[0].iov_len = TAP_RING - off;
+            iov[1].iov_base = t->ring;
+            iov[1].iov_len = len - iov[0].iov_len;
+            cnt = 2;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+        ssize_t n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            c->pos += (unsigned long long)n;
+            rc = (size_t)n < len;
+        } else if (errno == EAGAIN) {
+            c->blocked = 1;
+        } else if (errno == EINTR) {
+            rc = 1;
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&t->mtx);
+    return rc;
+}
+
+static void tap_drop(struct tap *t, struct tap_client *c) {
+    close(c->fd);
+    c->fd = -1;
+    pthread_mutex_lock(&t->mtx);
+    t->nclients--;
+    pthread_mutex_unlock(&t->mtx);
+}
+
+/* Catch every client up as far as its socket takes; arm EPOLLOUT for the
+   ones that fill up. */
+static void tap_serve(struct tap *t) {
+    for (struct tap_client *c = t->clients; c; c = c->next) {
+        if (c->fd < 0 || c->blocked)
+            continue;
+        int rc;
+        while ((rc = tap_send(t, c)) > 0)
+            ;
+        if (rc < 0) {
+            tap_drop(t, c);
+        } else if (c->blocked) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+            epoll_ctl(t->ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
+}
+
+static void tap_accept(struct tap *t) {
+    int fd;
+    while ((fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct tap_client *c = calloc(1, sizeof(*c));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (!c || epoll_ctl(t->ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        pthread_mutex_lock(&t->mtx);
+        c->pos = t->head;           /* new clients start with live data */
+        t->nclients++;
+        pthread_mutex_unlock(&t->mtx);
+        c->next = t->clients;
+        t->clients = c;
+    }
+}
+
+/* Free clients that went away during the last round. */
+static void tap_sweep(struct tap *t) {
+    struct tap_client **pp = &t->clients;
+    while (*pp) {
+        struct tap_client *c = *pp;
+        if (c->fd < 0) {
+            *pp = c->next;
+            free(c);
+        } else {
+            pp = &c->next;
+        }
+    }
+}
+
+static void *tap_thread(void *arg) {
+    struct tap *t = arg;
+    struct epoll_event evs[CONC_EVENTS];
+    for (;;) {
+        tap_serve(t);
+
+        /* Park unless more data came in meanwhile */
+        int busy = 0, quit;
+        pthread_mutex_lock(&t->mtx);
+        for (struct tap_client *c = t->clients; c; c = c->next)
+            if (c->fd >= 0 && !c->blocked && c->pos < t->head)
+                busy = 1;
+        quit = t->quit;
+        t->idle = !busy && !quit;
+        pthread_mutex_unlock(&t->mtx);
+        if (quit)
+            break;
+        if (busy)
+            continue;
+
+        int n = epoll_wait(t->ep, evs, CONC_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            struct tap_client *c = evs[i].data.ptr;
+            if (!c) {
+                uint64_t v;
+                if (read(t->wake_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                    perror("tap eventfd");
+            } else if (c == (void *)t) {
+                tap_accept(t);
+            } else if (c->fd >= 0) {
+                if (evs[i].events & EPOLLOUT) {
+                    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+                    epoll_ctl(t->ep, EPOLL_CTL_MOD, c->fd, &ev);
+                    c->blocked = 0;
+                }
+                if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    /* Clients only listen; input is discarded, EOF ends them */
+                    char junk[256];
+                    ssize_t nr = recv(c->fd, junk, sizeof(junk), MSG_DONTWAIT);
+                    if (nr == 0 || (nr < 0 && errno != EAGAIN && errno != EINTR))
+                        tap_drop(t, c);
+                }
+            }
+        }
+        tap_sweep(t);
+    }
+
+    /* Last round: pass on what fits without waiting, then hang up */
+    for (struct tap_client *c = t->clients; c; c = c->next)
+        c->blocked = 0;
+    tap_serve(t);
+    for (struct tap_client *c = t->clients; c; c = c->next)
+        if (c->fd >= 0)
+            close(c->fd);
+    return NULL;
+}
+
+static struct tap *tap_start(const char *path) {
+    struct tap *t = calloc(1, sizeof(*t));
+    if (!t || !(t->ring = malloc(TAP_RING)))
+        return NULL;
+    t->path = path;
+    pthread_mutex_init(&t->mtx, NULL);
+    if ((t->listen_fd = open_listener(path)) < 0 ||
+        (t->ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return NULL;
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = t };
+    struct epoll_event wev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(t->ep, EPOLL_CTL_ADD, t->listen_fd, &lev) < 0 ||
+        epoll_ctl(t->ep, EPOLL_CTL_ADD, t->wake_fd, &wev) < 0)
+        return NULL;
+    int err = pthread_create(&t->thread, NULL, tap_thread, t);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    return t;
+}
+
+static void tap_wake(struct tap *t) {
+    uint64_t one = 1;
+    if (write(t->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("tap eventfd");
+}
+
+/* Add data to the ring; the thread is only woken if it is parked. */
+static void tap_put(struct tap *t, const struct iovec *iov, int cnt) {
+    pthread_mutex_lock(&t->mtx);
+    for (int i = 0; i < cnt; i++) {
+        const char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        if (!t->nclients) {
+            t->head += len;     /* nobody to see it */
+            continue;
+        }
+        if (len > TAP_RING) {
+            t->head += len - TAP_RING;
+            p += len - TAP_RING;
+            len = TAP_RING;
+        }
+        while (len > 0) {
+            size_t off = (size_t)(t->head % TAP_RING);
+            size_t n = TAP_RING - off < len ? TAP_RING - off : len;
+            memcpy(t->ring + off, p, n);
+            t->head += n;
+            p += n;
+            len -= n;
+        }
+    }
+    int wake = t->idle && t->nclients;
+    if (wake)
+        t->idle = 0;
+    pthread_mutex_unlock(&t->mtx);
+    if (wake)
+        tap_wake(t);
+}
+
+static void tap_report(struct tap *t) {
+    pthread_mutex_lock(&t->mtx);
+    fprintf(stderr, "  tap    %d subscribers, %llu bytes skipped\n",
+            t->nclients, t->skipped);
+    pthread_mutex_unlock(&t->mtx);
+}
+
+static void tap_finish(struct tap *t) {
+    pthread_mutex_lock(&t->mtx);
+    t->quit = 1;
+    pthread_mutex_unlock(&t->mtx);
+    tap_wake(t);
+    pthread_join(t->thread, NULL);
+    tap_sweep(t);
+    for (struct tap_client *c = t->clients, *next; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    unlink(t->path);
+    close(t->listen_fd);
+    close(t->wake_fd);
+    close(t->ep);
+    free(t->ring);
+    free(t);
+}
+
+/* ---- non-blocking stdout ----------------------------------------------- */
+
+static int backlog_add(struct backlog *b, const char *p, size_t n) {
+    if (b->head + b->len + n > b->cap) {
+        memmove(b->buf, b->buf + b->head, b->len);
+        b->head = 0;
+    }
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 1024 * 1024;
+        while (cap < b->len + n)
+            cap *= 2;
+        char *buf = realloc(b->buf, cap);
+        if (!buf)
+            return -1;
+        b->buf = buf;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->head + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+/* Write as much of the backlog as stdout takes without blocking. */
+static int backlog_drain(struct backlog *b) {
+    while (b->len > 0) {
+        long long t0 = io_begin(&stats.out);
+        ssize_t nw = write(STDOUT_FILENO, b->buf + b->head, b->len);
+        io_end(&stats.out, t0, nw, b->len);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        b->head += (size_t)nw;
+        b->len -= (size_t)nw;
+    }
+    b->head = 0;
+    return 0;
+}
+
+/*
+ * Send data to stdout.  In --nonblock mode one write is tried if nothing
+ * is queued, and the rest goes to the backlog; queued data always goes
+ * first, so the stream stays in order.
+ */
+static int stdout_writev(const struct iovec *iov, int cnt) {
+    struct backlog *b = out_backlog;
+    if (out_tap)
+        tap_put(out_tap, iov, cnt);
+    if (!b)
+        return writev_all(STDOUT_FILENO, iov, cnt, &stats.out);
+
+    size_t done = 0;
+    if (b->len == 0) {
+        size_t want = 0;
+        for (int i = 0; i < cnt; i++)
+            want += iov[i].iov_len;
+        ssize_t nw;
+        do {
+            long long t0 = io_begin(&stats.out);
+            nw = writev(STDOUT_FILENO, iov, cnt);
+            io_end(&stats.out, t0, nw, want);
+        } while (nw < 0 && errno == EINTR);
+        if (nw < 0 && errno != EAGAIN)
+            return -1;
+        done = nw < 0 ? 0 : (size_t)nw;
+    }
+    for (int i = 0; i < cnt; i++) {
+        if (done >= iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            continue;
+        }
+        if (backlog_add(b, (const char *)iov[i].iov_base + done,
+                        iov[i].iov_len - done) < 0)
+            return -1;
+        done = 0;
+    }
+    return 0;
+}
+
+static void restore_stdout(void) {
+    fcntl(STDOUT_FILENO, F_SETFL, out_backlog->saved_flags);
+}
+
+/* ---- line stage --------------------------------------------------------- */
+
+static int carry_add(struct route *r, const char *p, size_t n) {
+    if (r->carry_len + n > r->carry_cap) {
+        size_t cap = r->carry_cap ? r->carry_cap : 4096;
+        while (cap < r->carry_len + n)
+            cap *= 2;
+        char *p2 = realloc(r->carry, cap);
+        if (!p2)
+            return -1;
+        r->carry = p2;
+        r->carry_cap = cap;
+    }
+    memcpy(r->carry + r->carry_len, p, n);
+    r->carry_len += n;
+    return 0;
+}
+
+static void route_flush(struct route *r) {
+    if (r->nout && writev_all(r->fd, r->out, r->nout, NULL) < 0)
+        die(r->pattern);
+    r->nout = 0;
+}
+
+/* Offer one line, or the piece of one that this read holds, to a route. */
+static void route_line(struct line_stage *ls, struct route *r, const char *p,
+                       size_t n, int fresh, int complete) {
+    if (fresh && complete) {
+        /* The common case: the whole line is in the buffer */
+        if (!memmem(p, n, r->pattern, r->plen))
+            return;
+        if (r->nout + 2 > IOV_MAX)
+            route_flush(r);
+        if (ls->timestamp) {
+            r->out[r->nout].iov_base = ls->prefix;
+            r->out[r->nout++].iov_len = ls->prefix_len;
+        }
+        r->out[r->nout].iov_base = (void *)p;
+        r->out[r->nout++].iov_len = n;
+        return;
+    }
+    if (fresh) {
+        r->carry_len = 0;
+        if (ls->timestamp && carry_add(r, ls->prefix, ls->prefix_len) < 0)
+            die("malloc");
+        r->carry_skip = r->carry_len;
+    }
+    if (carry_add(r, p, n) < 0)
+        die("malloc");
+    if (complete) {
+        if (memmem(r->carry + r->carry_skip, r->carry_len - r->carry_skip,
+                   r->pattern, r->plen)) {
+            route_flush(r);
+            if (write_all(r->fd, r->carry, r->carry_len, NULL) < 0)
+                die(r->pattern);
+        }
+        r->carry_len = 0;
+    }
+}
+
+static void stage_flush(struct line_stage *ls, struct sink *s) {
+    if (ls->nout) {
+        if (stdout_writev(ls->out, ls->nout) < 0)
+            die("write to stdout");
+        if (sink_writev(s, ls->out, ls->nout) < 0)
+            die("write to file");
+        ls->nout = 0;
+    }
+    for (int i = 0; i < ls->nroutes; i++)
+        route_flush(&ls->routes[i]);
+}
+
+/* One line, complete or not, to go out. */
+static void stage_line(struct line_stage *ls, struct sink *s, const char *p,
+                       size_t n, int complete) {
+    int fresh = !ls->in_line;
+    if (ls->nout + 2 > IOV_MAX)
+        stage_flush(ls, s);
+    if (ls->timestamp && fresh) {
+        ls->out[ls->nout].iov_base = ls->prefix;
+        ls->out[ls->nout++].iov_len = ls->prefix_len;
+    }
+    struct iovec *last = ls->nout ? &ls->out[ls->nout - 1] : NULL;
+    if (last && (const char *)last->iov_base + last->iov_len == p) {
+        last->iov_len += n;     /* adjacent lines go out as one piece */
+    } else {
+        ls->out[ls->nout].iov_base = (void *)p;
+        ls->out[ls->nout++].iov_len = n;
+    }
+    for (int i = 0; i < ls->nroutes; i++)
+        route_line(ls, &ls->routes[i], p, n, fresh, complete);
+    ls->in_line = !complete;
+    if (complete)
+        ls->lines++;
+}
+
+static void stage_feed(struct line_stage *ls, struct sink *s, const char *buf,
+                       size_t len) {
+    uint32_t offs[LINE_OFFS];
+    size_t pos = 0, start = 0, k;
+    do {
+        size_t done;
+        k = nl_scan(buf + pos, len - pos, offs, LINE_OFFS, &done);
+        for (size_t j = 0; j < k; j++) {
+            size_t end = pos + offs[j] + 1;
+            stage_line(ls, s, buf + start, end - start, 1);
+            start = end;
+        }
+        pos += done;
+    } while (k == LINE_OFFS && pos < len);
+    if (start < len)
+        stage_line(ls, s, buf + start, len - start, 0);
+}
+
+/* Render the prefix for data read now: "YYYY-MM-DDTHH:MM:SS.mmm " (UTC). */
+static void stage_stamp(struct line_stage *ls) {
+    struct timespec now;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    size_t n = strftime(ls->prefix, sizeof(ls->prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+    n += snprintf(ls->prefix + n, sizeof(ls->prefix) - n, ".%03ld ",
+                  now.tv_nsec / 1000000);
+    ls->prefix_len = n;
+}
+
+/* Send data to stdout and the file, through the line stage if there is one. */
+static void emit(struct sink *s, struct line_stage *ls, const struct iovec *iov,
+                 int cnt) {
+    if (!ls) {
+        if (stdout_writev(iov, cnt) < 0)
+            die("write to stdout");
+        if (sink_writev(s, iov, cnt) < 0)
+            die("write to file");
+        return;
+    }
+    if (ls->timestamp)
+        stage_stamp(ls);
+    for (int i = 0; i < cnt; i++)
+        stage_feed(ls, s, iov[i].iov_base, iov[i].iov_len);
+    stage_flush(ls, s);
+}
+
+/* Pass on a last unterminated line to the routes and report the count. */
+static void stage_finish(struct line_stage *ls) {
+    for (int i = 0; i < ls->nroutes; i++) {
+        struct route *r = &ls->routes[i];
+        if (r->carry_len && memmem(r->carry + r->carry_skip,
+                                   r->carry_len - r->carry_skip,
+                                   r->pattern, r->plen) &&
+            write_all(r->fd, r->carry, r->carry_len, NULL) < 0)
+            die(r->pattern);
+        if (close(r->fd) < 0)
+            die(r->pattern);
+        free(r->carry);
+    }
+    if (ls->count)
+        fprintf(stderr, "%llu lines\n", (unsigned long long)ls->lines);
+}
+
+/* Read from stdin and write to both stdout and the file */
+static void copy_stdin(struct sink *s, struct line_stage *ls, size_t bufsize) {
+    char *buf = malloc(bufsize);
+    if (!buf)
+        die("malloc");
+    ssize_t nread;
+    for (;;) {
+        stats_poll();
+        nread = io_read(STDIN_FILENO, buf, bufsize, &stats.in);
+        if (nread < 0 && errno == EINTR) {
+            /* A timer fired while the producer was idle */
+            if (sink_idle(s) < 0)
+                die("sync file");
+            continue;
+        }
+        if (nread <= 0)
+            break;
+        if (ls) {
+            struct iovec iov = { buf, (size_t)nread };
+            emit(s, ls, &iov, 1);
+            continue;
+        }
+        /* Write to stdout and any subscribers */
+        if (out_tap) {
+            struct iovec iov = { buf, (size_t)nread };
+            tap_put(out_tap, &iov, 1);
+        }
+        if (write_all(STDOUT_FILENO, buf, nread, &stats.out) < 0)
+            die("write to stdout");
+        /* Write to file */
+        if (sink_write(s, buf, nread) < 0)
+            die("write to file");
+    }
+    if (nread < 0)
+        die("read");
+    free(buf);
+}
+
+/*
+ * --mmap with nothing that transforms the data: read straight into the
+ * file's mapping and write stdout from there, so the file costs no system
+ * call at all.
+ */
+static void copy_stdin_mmap(struct sink *s) {
+    ssize_t nread;
+    for (;;) {
+        stats_poll();
+        if ((s->rotate_size || s->rotate_ms) && sink_rotation_due(s) &&
+            sink_rotate(s) < 0)
+            die("write to file");
+        size_t avail;
+        char *p = map_space(s, s->pos, &avail);
+        if (!p)
+            die("map file");
+        nread = io_read(STDIN_FILENO, p, avail, &stats.in);
+        if (nread < 0 && errno == EINTR) {
+            if (sink_idle(s) < 0)
+                die("sync file");
+            continue;
+        }
+        if (nread <= 0)
+            break;
+        if (out_tap) {
+            struct iovec iov = { p, (size_t)nread };
+            tap_put(out_tap, &iov, 1);
+        }
+        if (write_all(STDOUT_FILENO, p, nread, &stats.out) < 0)
+            die("write to stdout");
+        if (sink_advance(s, (size_t)nread) < 0)
+            die("write to file");
+    }
+    if (nread < 0)
+        die("read");
+}
+
+/*
+ * --nonblock: wait for stdin to be readable or stdout to be writable,
+ * whichever comes first.  What is read goes to the file right away; stdout
+ * gets what it can take and the backlog holds the rest, so a stalled
+ * consumer no longer holds up the file.
+ */
+static void copy_stdin_nonblock(struct sink *s, struct line_stage *ls, size_t bufsize) {
+    struct backlog *b = out_backlog;
+    char *buf = malloc(bufsize);
+    if (!buf)
+        die("malloc");
+    int eof = 0;
+    while (!eof || b->len > 0) {
+        stats_poll();
+        struct pollfd pfd[2];
+        int n = 0, in = -1, out = -1;
+        if (!eof && b->len < b->limit) {
+            in = n;
+            pfd[n++] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+        }
+        if (b->len > 0) {
+            out = n;
+            pfd[n++] = (struct pollfd){ .fd = STDOUT_FILENO, .events = POLLOUT };
+        }
+        if (poll(pfd, n, -1) < 0) {
+            if (errno != EINTR)
+                die("poll");
+            if (sink_idle(s) < 0)
+                die("sync file");
+            continue;
+        }
+        if (out >= 0 && pfd[out].revents && backlog_drain(b) < 0)
+            die("write to stdout");
+        if (in < 0 || !pfd[in].revents)
+            continue;
+        ssize_t nread = io_read(STDIN_FILENO, buf, bufsize, &stats.in);
+        if (nread < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                die("read");
+            continue;
+        }
+        if (nread == 0) {
+            eof = 1;
+            continue;
+        }
+        struct iovec iov = { buf, (size_t)nread };
+        emit(s, ls, &iov, 1);
+    }
+    free(buf);
+}
+
+static void vmsplice_all(const char *p, size_t len) {
+    while (len > 0) {
+        struct iovec iov = { (void *)p, len };
+        long long t0 = io_begin(&stats.out);
+        ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_GIFT);
+        io_end(&stats.out, t0, n, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                stats_poll();
+                continue;
+            }
+            die("vmsplice to stdout");
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * stdout is a pipe: read into a page-aligned buffer and hand its pages to
+ * the pipe with vmsplice() instead of copying them in with write().  The
+ * file is written from the same buffer.  Gifted pages belong to the pipe,
+ * and a reader may still hold them long after FIONREAD says the pipe is
+ * empty (tee() them elsewhere, say), so the buffer gets fresh pages mapped
+ * over it before every read.
+ */
+static void copy_stdin_vmsplice(struct sink *s) {
+    char *buf = mmap(NULL, VMS_BUF, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        die("mmap");
+
+    ssize_t nread;
+    for (;;) {
+        stats_poll();
+        nread = io_read(STDIN_FILENO, buf, VMS_BUF, &stats.in);
+        if (nread < 0 && errno == EINTR) {
+            if (sink_idle(s) < 0)
+                die("sync file");
+            continue;
+        }
+        if (nread <= 0)
+            break;
+        if (out_tap) {
+            struct iovec iov = { buf, (size_t)nread };
+            tap_put(out_tap, &iov, 1);
+        }
+        vmsplice_all(buf, (size_t)nread);
+        if (sink_write(s, buf, nread) < 0)
+            die("write to file");
+        if (mmap(buf, VMS_BUF, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            die("mmap");
+    }
+    if (nread < 0)
+        die("read");
+    /* The old pages go away once the pipe lets go of them */
+    munmap(buf, VMS_BUF);
+}
+
+/* ---- parallel outputs --------------------------------------------------- */
+
+static void *output_thread(void *arg) {
+    struct output *o = arg;
+    struct tee *t = o->tee;
+
+    pthread_mutex_lock(&t->mtx);
+    for (;;) {
+        while (o->next == t->head && !t->eof)
+            pthread_cond_wait(&t->data, &t->mtx);
+        if (o->next == t->head)
+            break;
+        struct chunk *c = t->ring[o->next % t->nchunks];
+        pthread_mutex_unlock(&t->mtx);
+
+        if (!o->sink) {
+            if (write_all(STDOUT_FILENO, c->data, c->len, &stats.out) < 0)
+                die("write to stdout");
+        } else if (sink_write(o->sink, c->data, c->len) < 0) {
+            die(o->sink->path);
+        }
+
+        pthread_mutex_lock(&t->mtx);
+        o->next++;
+        o->done += c->len;
+        if (--c->refs == 0) {
+            c->next = t->free;
+            t->free = c;
+            pthread_cond_signal(&t->space);
+        }
+    }
+    pthread_mutex_unlock(&t->mtx);
+    return NULL;
+}
+
+/* Set up chunks of chunk_size bytes, lag bytes' worth of them, and start a
+   writer for stdout and one for each sink.  cpus[i] pins output i. */
+static struct tee *tee_start(struct sink **sinks, int nsinks, size_t chunk_size,
+                             long long lag, const int *cpus, int ncpus) {
+    struct tee *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->nchunks = lag / (long long)chunk_size < 2 ? 2 : (int)(lag / (long long)chunk_size);
+    if (!(t->ring = calloc(t->nchunks, sizeof(*t->ring))))
+        return NULL;
+    for (int i = 0; i < t->nchunks; i++) {
+        struct chunk *c = malloc(sizeof(*c) + chunk_size);
+        if (!c)
+            return NULL;
+        c->next = t->free;
+        t->free = c;
+    }
+    pthread_mutex_init(&t->mtx, NULL);
+    pthread_cond_init(&t->data, NULL);
+    pthread_cond_init(&t->space, NULL);
+
+    t->nout = nsinks + 1;
+    for (int i = 0; i < t->nout; i++) {
+        struct output *o = &t->out[i];
+        o->tee = t;
+        o->sink = i ? sinks[i - 1] : NULL;
+        o->cpu = i < ncpus ? cpus[i] : -1;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (o->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(o->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        int err = pthread_create(&o->thread, &attr, output_thread, o);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            errno = err;
+            return NULL;
+        }
+    }
+    return t;
+}
+
+/* Read stdin into chunks and hand each one to all the writers. */
+static void copy_stdin_tee(struct tee *t, size_t chunk_size) {
+    ssize_t nread;
+    for (;;) {
+        stats_poll();
+        pthread_mutex_lock(&t->mtx);
+        while (!t->free)
+            pthread_cond_wait(&t->space, &t->mtx);
+        struct chunk *c = t->free;
+        t->free = c->next;
+        pthread_mutex_unlock(&t->mtx);
+
+        do {
+            stats_poll();
+            nread = io_read(STDIN_FILENO, c->data, chunk_size, &stats.in);
+        } while (nread < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&t->mtx);
+        if (nread <= 0) {
+            c->next = t->free;
+            t->free = c;
+            t->eof = 1;
+            pthread_cond_broadcast(&t->data);
+            pthread_mutex_unlock(&t->mtx);
+            break;
+        }
+        c->len = (size_t)nread;
+        c->refs = t->nout;
+        t->ring[t->head++ % t->nchunks] = c;
+        t->read += (unsigned long long)nread;
+        pthread_cond_broadcast(&t->data);
+        pthread_mutex_unlock(&t->mtx);
+        if (out_tap) {
+            struct iovec iov = { c->data, c->len };
+            tap_put(out_tap, &iov, 1);
+        }
+    }
+    for (int i = 0; i < t->nout; i++)
+        pthread_join(t->out[i].thread, NULL);
+    if (nread < 0)
+        die("read");
+}
+
+static void tee_report(struct tee *t) {
+    pthread_mutex_lock(&t->mtx);
+    for (int i = 0; i < t->nout; i++) {
+        struct output *o = &t->out[i];
+        fprintf(stderr, "  %-6s lag %llu bytes in %llu chunks",
+                o->sink ? o->sink->path : "stdout", t->read - o->done,
+                t->head - o->next);
+        if (o->cpu >= 0)
+            fprintf(stderr, ", on CPU %d", o->cpu);
+        fputc('\n', stderr);
+    }
+    pthread_mutex_unlock(&t->mtx);
+}
+
+/* ---- concentrator ------------------------------------------------------- */
+
+enum { SRC_STREAM, SRC_FIFO, SRC_LISTEN };
+
+/* One input of the concentrator: a producer, or the socket accepting them. */
+struct source {
+    int kind;
+    int fd;
+    int keep_fd;                /* FIFO only: our own writer, so it never EOFs */
+    char *buf;                  /* partial record carried between reads */
+    size_t len;
+};
+
+static struct source *source_add(int ep, int kind, int fd) {
+    struct source *src = calloc(1, sizeof(*src));
+    if (!src)
+        return NULL;
+    src->kind = kind;
+    src->fd = fd;
+    src->keep_fd = -1;
+    if (kind != SRC_LISTEN && !(src->buf = malloc(CONC_BUF))) {
+        free(src);
+        return NULL;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(src->buf);
+        free(src);
+        return NULL;
+    }
+    return src;
+}
+
+static int stdin_flags = -1;    /* stdin's status flags before -c changed them */
+
+/* O_NONBLOCK is on the open file description, which we share with whoever
+   handed us stdin; put it back as we found it. */
+static void restore_stdin(void) {
+    if (stdin_flags >= 0)
+        fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+}
+
+static void source_free(struct source *src) {
+    if (src->fd == STDIN_FILENO)
+        restore_stdin();
+    close(src->fd);
+    if (src->keep_fd >= 0)
+        close(src->keep_fd);
+    free(src->buf);
+    free(src);
+}
+
+static int open_listener(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);               /* stale socket from an earlier run */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Open a FIFO for reading, creating it if needed.  We also hold a write end
+   ourselves, so the FIFO does not report EOF each time the last producer
+   goes away. */
+static int open_fifo(const char *path, int *keep_fd) {
+    if (mkfifo(path, 0660) < 0 && errno != EEXIST)
+        return -1;
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    *keep_fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (*keep_fd < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read what one producer has for us and queue its complete records (up to
+ * the last newline) for the batch.  The partial record after it stays in
+ * the producer's buffer until the rest arrives.  Only a record that fills
+ * the whole buffer without a newline is passed on as is; one left over at
+ * EOF gets a newline.  Returns 1 at EOF, 0 otherwise, -1 on error.
+ */
+static int source_read(struct source *src, struct iovec *iov, int *cnt,
+                       size_t *queued) {
+    static char newline = '\n';
+    *queued = 0;
+    ssize_t nr = io_read(src->fd, src->buf + src->len, CONC_BUF - src->len, &stats.in);
+    if (nr < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    src->len += (size_t)nr;
+
+    size_t n = src->len;
+    if (nr > 0) {
+        char *nl = memrchr(src->buf, '\n', n);
+        if (nl)
+            n = (size_t)(nl - src->buf) + 1;
+        else if (n < CONC_BUF)
+            n = 0;
+    }
+    if (n > 0) {
+        iov[*cnt].iov_base = src->buf;
+        iov[(*cnt)++].iov_len = n;
+        if (nr == 0 && src->buf[n - 1] != '\n') {
+            iov[*cnt].iov_base = &newline;
+            iov[(*cnt)++].iov_len = 1;
+        }
+    }
+    *queued = n;
+    return nr == 0;
+}
+
+/*
+ * A regular file on stdin is always readable, so epoll will not take it:
+ * copy its records before serving the other producers.
+ */
+static void concentrate_file(struct sink *s, struct line_stage *ls) {
+    struct source file = { .kind = SRC_STREAM, .fd = STDIN_FILENO, .keep_fd = -1 };
+    struct iovec iov[2];
+    if (!(file.buf = malloc(CONC_BUF)))
+        die("malloc");
+    for (;;) {
+        int cnt = 0;
+        size_t queued;
+        int r = source_read(&file, iov, &cnt, &queued);
+        if (r < 0)
+            die("read");
+        if (cnt > 0)
+            emit(s, ls, iov, cnt);
+        file.len -= queued;
+        memmove(file.buf, file.buf + queued, file.len);
+        if (r)
+            break;
+    }
+    free(file.buf);
+}
+
+/*
+ * Concentrator mode.  Many producers (stdin, FIFOs, and clients of a Unix
+ * stream socket) are multiplexed with epoll.
+ * Every wake-up collects the complete records of all ready producers and
+ * writes them with a single writev() per output, so records never
+ * interleave and a busy concentrator issues a few large writes instead of
+ * one small O_APPEND write per producer per record.
+ */
+static void concentrate(struct sink *s, struct line_stage *ls, const char *listen_path,
+                        char **fifos, int nfifos) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0)
+        die("epoll_create1");
+
+    int endpoints = 0, producers = 0;
+    struct stat st;
+    int have_stdin = fstat(STDIN_FILENO, &st) == 0;
+    if (have_stdin && S_ISREG(st.st_mode)) {
+        concentrate_file(s, ls);
+    } else if (have_stdin) {
+        /* Pipes, sockets and terminals; epoll refuses /dev/null with EPERM */
+        struct source *src = source_add(ep, SRC_STREAM, STDIN_FILENO);
+        if (!src && errno != EPERM)
+            die("epoll_ctl stdin");
+        if (src) {
+            if ((stdin_flags = fcntl(STDIN_FILENO, F_GETFL)) < 0 ||
+                fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK) < 0)
+                die("fcntl stdin");
+            atexit(restore_stdin);
+            producers++;
+        }
+    }
+    for (int i = 0; i < nfifos; i++) {
+        int keep_fd;
+        int fd = open_fifo(fifos[i], &keep_fd);
+        struct source *src = fd < 0 ? NULL : source_add(ep, SRC_FIFO, fd);
+        if (!src)
+            die(fifos[i]);
+        src->keep_fd = keep_fd;
+        endpoints++;
+    }
+    if (listen_path) {
+        int fd = open_listener(listen_path);
+        if (fd < 0 || !source_add(ep, SRC_LISTEN, fd))
+            die(listen_path);
+        endpoints++;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0)
+        die("sigaction");
+
+    struct epoll_event evs[CONC_EVENTS];
+    struct iovec iov[2 * CONC_EVENTS];
+    struct source *done[CONC_EVENTS];
+    size_t queued[CONC_EVENTS];
+
+    while (!stop_requested && (endpoints > 0 || producers > 0)) {
+        stats_poll();
+        int n = epoll_wait(ep, evs, CONC_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                die("epoll_wait");
+            if (sink_idle(s) < 0)
+                die("sync file");
+            continue;
+        }
+
+        int cnt = 0, nsrc = 0;
+        int eof[CONC_EVENTS];
+        for (int i = 0; i < n; i++) {
+            struct source *src = evs[i].data.ptr;
+            if (src->kind == SRC_LISTEN) {
+                int fd;
+                while ((fd = accept4(src->fd, NULL, NULL,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    if (!source_add(ep, SRC_STREAM, fd))
+                        die("epoll_ctl");
+                    producers++;
+                }
+                if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                    die("accept");
+                continue;
+            }
+            int r = source_read(src, iov, &cnt, &queued[nsrc]);
+            if (r < 0)
+                die("read");
+            done[nsrc] = src;
+            eof[nsrc++] = r;
+        }
+        if (cnt == 0 && nsrc == 0)
+            continue;
+
+        if (cnt > 0)
+            emit(s, ls, iov, cnt);
+
+        /* The batch is out; keep only the partial records */
+        for (int i = 0; i < nsrc; i++) {
+            struct source *src = done[i];
+            src->len -= queued[i];
+            memmove(src->buf, src->buf + queued[i], src->len);
+            if (eof[i]) {
+                if (src->kind == SRC_STREAM)
+                    producers--;
+                source_free(src);
+            }
+        }
+    }
+
+    if (listen_path)
+        unlink(listen_path);
+    close(ep);
+}
+
+/* Arm a periodic SIGALRM that marks a sync as due.  No SA_RESTART, so a
+   read() blocked on an idle producer returns EINTR and the data already
+   written still gets synced on time. */
+static void start_sync_timer(long long ms) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_alarm;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGALRM, &sa, NULL) < 0)
+        die("sigaction");
+    struct itimerval it;
+    it.it_interval.tv_sec = ms / 1000;
+    it.it_interval.tv_usec = (ms % 1000) * 1000;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_REAL, &it, NULL) < 0)
+        die("setitimer");
 }
 
 int main(int argc, char *argv[]) {
     int append_mode = 0;
+    struct sink sink = { .fd = -1, .next_fd = -1 };
+    const char *zcmd = NULL;
+    int concentrator = 0;
+    enum frame_mode frame_mode = FRAME_NONE;
+    long long idx_every = 0, idx_bucket = 0;
+    struct line_stage stage = { 0 };
+    int compress = 0;
+    int use_vmsplice = 0;
+    long long bufsize = 4096;
+    long long stats_ms = 0;
+    long long backlog = 0;
+    const char *tap_path = NULL;
+    long long max_lag = TEE_LAG;
+    int cpus[MAX_FILES + 1], ncpus = 0;
+    char *routes[MAX_ROUTES];
+    const char *listen_path = NULL;
+    char *fifos[CONC_MAX_FIFOS];
+    int nfifos = 0;
     int opt;
 
+    static const struct option longopts[] = {
+        { "sync", required_argument, NULL, 'S' },
+        { "stream", optional_argument, NULL, 'W' },
+        { "prealloc", optional_argument, NULL, 'P' },
+        { "rotate-size", required_argument, NULL, 'R' },
+        { "rotate-interval", required_argument, NULL, 'I' },
+        { "rotate-compress", optional_argument, NULL, 'Z' },
+        { "listen", required_argument, NULL, 'L' },
+        { "fifo", required_argument, NULL, 'F' },
+        { "frame", required_argument, NULL, 'f' },
+        { "index", required_argument, NULL, 'X' },
+        { "index-time", required_argument, NULL, 'T' },
+        { "timestamp", no_argument, NULL, 't' },
+        { "count", no_argument, NULL, 'n' },
+        { "route", required_argument, NULL, 'r' },
+        { "compress", no_argument, NULL, 'z' },
+        { "vmsplice", no_argument, NULL, 'V' },
+        { "stats-interval", required_argument, NULL, 'M' },
+        { "nonblock", optional_argument, NULL, 'N' },
+        { "mmap", optional_argument, NULL, 'm' },
+        { "tap", required_argument, NULL, 'p' },
+        { "max-lag", required_argument, NULL, 'G' },
+        { "cpus", required_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 }
+    };
+
     /* Parse options */
-    while ((opt = getopt(argc, argv, "a")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ab:cdz", longopts, NULL)) != -1) {
         switch (opt) {
         case 'a':
             append_mode = 1;
             break;
+        case 'b':
+            bufsize = parse_size(optarg);
+            if (bufsize <= 0 || bufsize > INT_MAX) {
+                fprintf(stderr, "%s: invalid buffer size '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            concentrator = 1;
+            break;
+        case 'f':
+            if (strcmp(optarg, "chunk") == 0) {
+                frame_mode = FRAME_CHUNK;
+            } else if (strcmp(optarg, "line") == 0) {
+                frame_mode = FRAME_LINE;
+            } else {
+                fprintf(stderr, "%s: invalid frame mode '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            sink.direct = 1;
+            break;
+        case 'L':
+            listen_path = optarg;
+            break;
+        case 'F':
+            if (nfifos == CONC_MAX_FIFOS) {
+                fprintf(stderr, "%s: too many FIFOs\n", argv[0]);
+                usage(argv[0]);
+            }
+            fifos[nfifos++] = optarg;
+            break;
+        case 'S':
+            if (parse_sync(optarg, &sink.sync) < 0) {
+                fprintf(stderr, "%s: invalid sync policy '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'W':
+            sink.window = optarg ? parse_size(optarg) : STREAM_WINDOW;
+            if (sink.window <= 0 || sink.window % sysconf(_SC_PAGESIZE) != 0) {
+                fprintf(stderr, "%s: stream window must be a multiple of "
+                        "the page size\n", argv[0]);
+                usage(argv[0]);
+            }
+            break;
+        case 'P':
+            sink.prealloc = optarg ? parse_size(optarg) : PREALLOC_CHUNK;
+            if (sink.prealloc <= 0) {
+                fprintf(stderr, "%s: invalid preallocation size '%s'\n",
+                        argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'R':
+            sink.rotate_size = parse_size(optarg);
+            if (sink.rotate_size <= 0) {
+                fprintf(stderr, "%s: invalid rotation size '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'I':
+            sink.rotate_ms = parse_duration(optarg);
+            if (sink.rotate_ms <= 0) {
+                fprintf(stderr, "%s: invalid rotation interval '%s'\n",
+                        argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'Z':
+            zcmd = optarg ? optarg : "gzip";
+            break;
+        case 'X':
+            idx_every = parse_size(optarg);
+            if (idx_every <= 0) {
+                fprintf(stderr, "%s: invalid index interval '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'T':
+            idx_bucket = parse_duration(optarg) / 1000;
+            if (idx_bucket <= 0) {
+                fprintf(stderr, "%s: invalid index bucket '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            stage.timestamp = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'V':
+            use_vmsplice = 1;
+            break;
+        case 'p':
+            tap_path = optarg;
+            break;
+        case 'G':
+            max_lag = parse_size(optarg);
+            if (max_lag <= 0) {
+                fprintf(stderr, "%s: invalid lag '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'C':
+            /* Comma-separated, one CPU per output: stdout, then the files */
+            for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                char *end;
+                long cpu = strtol(tok, &end, 10);
+                if (*end || cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_CONF) ||
+                    cpu >= CPU_SETSIZE || ncpus == MAX_FILES + 1) {
+                    fprintf(stderr, "%s: invalid CPU list\n", argv[0]);
+                    usage(argv[0]);
+                }
+                cpus[ncpus++] = (int)cpu;
+            }
+            break;
+        case 'm':
+            sink.map_size = optarg ? parse_size(optarg) : MAP_WINDOW;
+            if (sink.map_size <= 0 || sink.map_size % sysconf(_SC_PAGESIZE) != 0) {
+                fprintf(stderr, "%s: mmap window must be a multiple of "
+                        "the page size\n", argv[0]);
+                usage(argv[0]);
+            }
+            break;
+        case 'N':
+            backlog = optarg ? parse_size(optarg) : BACKLOG_MAX;
+            if (backlog <= 0) {
+                fprintf(stderr, "%s: invalid backlog size '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'M':
+            stats_ms = parse_duration(optarg);
+            if (stats_ms <= 0) {
+                fprintf(stderr, "%s: invalid stats interval '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            stage.count = 1;
+            break;
+        case 'r':
+            if (stage.nroutes == MAX_ROUTES || !strrchr(optarg, ':')) {
+                fprintf(stderr, "%s: invalid route '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            routes[stage.nroutes++] = optarg;
+            break;
         default:
             usage(argv[0]);
         }
     }
 
-    /* Must have exactly one non-option argument: the filename */
-    if (optind + 1 != argc) {
+    /* The file, optionally followed by more files for the same stream */
+    int nextra = argc - optind - 1;
+    if (nextra < 0 || nextra > MAX_FILES - 1) {
+        usage(argv[0]);
+    }
+    sink.path = argv[optind];
+    int parallel = nextra > 0 || ncpus > 0;
+    if (parallel && (concentrator || use_vmsplice || backlog ||
+                     stage.timestamp || stage.count || stage.nroutes ||
+                     sink.sync.mode == SYNC_INTERVAL)) {
+        fprintf(stderr, "%s: several files or --cpus cannot be combined with -c, "
+                "--vmsplice, --nonblock, line options or --sync=interval\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (sink.direct && append_mode) {
+        /* Writes go to offsets of our own, which would overwrite whatever
+           another writer appends meanwhile */
+        fprintf(stderr, "%s: -a cannot be combined with -d\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (sink.prealloc && append_mode) {
+        fprintf(stderr, "%s: --prealloc cannot be combined with -a\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (sink.direct && sink.window) {
+        fprintf(stderr, "%s: --stream has no effect with -d\n", argv[0]);
+        usage(argv[0]);
+    }
+    if ((listen_path || nfifos) && !concentrator) {
+        fprintf(stderr, "%s: --listen and --fifo need -c\n", argv[0]);
+        usage(argv[0]);
+    }
+    if ((idx_every || idx_bucket) && frame_mode != FRAME_NONE) {
+        fprintf(stderr, "%s: --index cannot be combined with --frame\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (compress && (idx_every || idx_bucket || frame_mode != FRAME_NONE)) {
+        fprintf(stderr, "%s: --compress cannot be combined with --index or "
+                "--frame\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (sink.map_size && (append_mode || sink.direct || sink.prealloc)) {
+        fprintf(stderr, "%s: --mmap cannot be combined with -a, -d or "
+                "--prealloc\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (use_vmsplice && (concentrator || stage.timestamp || stage.count ||
+                         stage.nroutes)) {
+        fprintf(stderr, "%s: --vmsplice cannot be combined with -c or line "
+                "options\n", argv[0]);
+        usage(argv[0]);
+    }
+    struct stat st;
+    if (use_vmsplice && (fstat(STDOUT_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode))) {
+        fprintf(stderr, "%s: --vmsplice needs stdout to be a pipe\n", argv[0]);
+        usage(argv[0]);
+    }
+    if (backlog && (concentrator || use_vmsplice)) {
+        fprintf(stderr, "%s: --nonblock cannot be combined with -c or --vmsplice\n",
+                argv[0]);
+        usage(argv[0]);
+    }
+    int rotating = sink.rotate_size || sink.rotate_ms;
+    if (zcmd && !rotating) {
+        fprintf(stderr, "%s: --rotate-compress needs --rotate-size or "
+                "--rotate-interval\n", argv[0]);
         usage(argv[0]);
     }
-    const char *filename = argv[optind];
 
     /* Open the file for writing (create if needed), with appropriate flags */
-    int flags = O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC);
-    int fd = open(filename, flags, 0644);
-    if (fd == -1) {
-        perror("open");
-        exit(EXIT_FAILURE);
+    int fd = open(sink.path, sink_flags(&sink, append_mode), 0644);
+    if (fd == -1)
+        die("open");
+    if (sink_attach(&sink, fd, append_mode) < 0)
+        die(sink.direct ? "O_DIRECT setup" : "lseek");
+    if (rotating && sink_prepare_next(&sink) < 0)
+        die("create next segment");
+    if (zcmd && !(sink.zq = compressor_start(zcmd)))
+        die("start compressor");
+    if (idx_every || idx_bucket) {
+        if (!(sink.idx = calloc(1, sizeof(*sink.idx))))
+            die("calloc");
+        sink.idx->every = idx_every;
+        sink.idx->bucket = idx_bucket;
+        if (idx_open(sink.idx, sink.path, append_mode) < 0)
+            die("open index");
+    }
+    if (frame_mode != FRAME_NONE) {
+        if (!(sink.fr = calloc(1, sizeof(*sink.fr))))
+            die("calloc");
+        sink.fr->mode = frame_mode;
     }
+    for (int i = 0; i < stage.nroutes; i++) {
+        /* PATTERN:FILE, split at the last colon */
+        struct route *r = &stage.routes[i];
+        char *colon = strrchr(routes[i], ':');
+        *colon = '\0';
+        r->pattern = routes[i];
+        r->plen = strlen(r->pattern);
+        r->fd = open(colon + 1, O_WRONLY | O_CREAT | O_CLOEXEC |
+                     (append_mode ? O_APPEND : O_TRUNC), 0644);
+        if (r->fd < 0)
+            die(colon + 1);
+    }
+    if (compress && lz_start(&sink) < 0)
+        die("start compression");
 
-    /* Read from stdin and write to both stdout and the file */
-    char buf[4096];
-    ssize_t nread;
-    while ((nread = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-        /* Write to stdout */
-        ssize_t nw = write(STDOUT_FILENO, buf, nread);
-        if (nw != nread) {
-            perror("write to stdout");
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
-        /* Write to file */
-        nw = write(fd, buf, nread);
-        if (nw != nread) {
-            perror("write to file");
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
+    /* Further files get the same write path, without the per-segment
+       extras (rotation, framing, index, compression) */
+    struct sink extra[MAX_FILES - 1];
+    struct sink *sinks[MAX_FILES];
+    sinks[0] = &sink;
+    for (int i = 0; i < nextra; i++) {
+        struct sink *x = &extra[i];
+        *x = (struct sink){ .path = argv[optind + 1 + i], .fd = -1, .next_fd = -1,
+                            .direct = sink.direct, .sync = sink.sync,
+                            .window = sink.window, .prealloc = sink.prealloc,
+                            .map_size = sink.map_size };
+        int xfd = open(x->path, sink_flags(x, append_mode), 0644);
+        if (xfd < 0 || sink_attach(x, xfd, append_mode) < 0)
+            die(x->path);
+        sinks[1 + i] = x;
     }
-    if (nread < 0) {
-        perror("read");
-        close(fd);
-        exit(EXIT_FAILURE);
+    struct line_stage *ls = NULL;
+    if (stage.timestamp || stage.count || stage.nroutes)
+        ls = &stage;
+    if (sink.sync.mode == SYNC_INTERVAL)
+        start_sync_timer(sink.sync.arg);
+
+    /* SIGUSR1 prints the counters; like SIGALRM it interrupts a blocked
+       read or write so a stalled pipeline still reports */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stats;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) < 0)
+        die("sigaction");
+    stats.main = pthread_self();
+    stats.start = clock_ns();
+    stats.sink = parallel ? NULL : &sink;   /* staging is the writers' business */
+    if (stats_ms)
+        start_stats_timer(stats_ms);
+
+    if (tap_path && !(out_tap = tap_start(tap_path)))
+        die(tap_path);
+
+    /* The flag is on the open file description, which other processes may
+       share, so it is put back however we exit */
+    static struct backlog out_queue;
+    if (backlog) {
+        out_queue.limit = (size_t)backlog;
+        if ((out_queue.saved_flags = fcntl(STDOUT_FILENO, F_GETFL)) < 0 ||
+            fcntl(STDOUT_FILENO, F_SETFL, out_queue.saved_flags | O_NONBLOCK) < 0)
+            die("fcntl stdout");
+        out_backlog = &out_queue;
+        atexit(restore_stdout);
     }
 
+    if (parallel && !(out_tee = tee_start(sinks, 1 + nextra, (size_t)bufsize,
+                                          max_lag, cpus, ncpus)))
+        die("start writers");
+
+    if (out_tee)
+        copy_stdin_tee(out_tee, (size_t)bufsize);
+    else if (concentrator)
+        concentrate(&sink, ls, listen_path, fifos, nfifos);
+    else if (use_vmsplice)
+        copy_stdin_vmsplice(&sink);
+    else if (out_backlog)
+        copy_stdin_nonblock(&sink, ls, bufsize);
+    else if (sink.map_size && !ls && !sink.fr && !sink.lz && !sink.idx)
+        copy_stdin_mmap(&sink);
+    else
+        copy_stdin(&sink, ls, bufsize);
+
     /* Clean up */
-    if (close(fd) < 0) {
-        perror("close");
+    if (ls)
+        stage_finish(ls);
+    if (out_tap)
+        tap_finish(out_tap);
+    if (sink.fr && frame_finish(&sink) < 0)
+        die("write to file");
+    if (sink.lz && lz_finish(&sink) < 0)
+        die("write to file");
+    if (sink.idx && sink.idx->collecting && idx_decide(sink.idx) < 0)
+        die("write index");
+    if (sink_close(&sink) < 0)
         exit(EXIT_FAILURE);
+    if (sink.idx)
+        close(sink.idx->fd);
+    if (sink.next_fd >= 0) {
+        char next[PATH_MAX];
+        next_path(&sink, next, sizeof(next));
+        close(sink.next_fd);
+        unlink(next);
     }
+    if (sink.zq)
+        compressor_finish(sink.zq);
+    for (int i = 0; i < nextra; i++)
+        if (sink_close(&extra[i]) < 0)
+            exit(EXIT_FAILURE);
 
     return EXIT_SUCCESS;
 }
-
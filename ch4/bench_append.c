@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Throughput benchmark for append.  Each strategy (a set of append options)
+ * is run on the same generated input, delivered through a pipe, a Unix
+ * socket or a regular file, at a chosen chunk size and optionally a capped
+ * rate.  stdout goes through a pipe to a child that discards it, and the
+ * file lands in the output directory.  For every strategy the median of
+ * the successful runs is reported:
+ *
+ *   GB/s         input bytes over wall time
+ *   syscalls/GB  read and write calls made by append (/proc/PID/io)
+ *   CPU s/GB     user + system time of append
+ */
+
+#define MAX_STRATEGIES 32
+#define MAX_RUNS 15
+#define PATTERN_SIZE (1024 * 1024)
+
+struct strategy {
+    const char *name;
+    const char *args;           /* extra append options, space separated */
+};
+
+static const struct strategy defaults[] = {
+    { "read/write 4K", "" },
+    { "read/write 1M", "-b 1M" },
+    { "vmsplice", "--vmsplice" },
+    { "O_DIRECT", "-b 1M -d" },
+    { "drop-behind", "-b 1M --stream" },
+    { "mmap", "--mmap" },
+    { "lz4", "-b 1M -z" },
+};
+
+struct result {
+    double secs;
+    double syscalls;
+    double cpu;
+};
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+            "Usage: %s [-p append] [-i pipe|socket|file] [-c chunk] [-r MB/s]\n"
+            "          [-s size] [-n runs] [-o dir] [-S name=options]...\n",
+            progname);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static long long parse_size(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return (*end || v <= 0) ? -1 : v;
+}
+
+/* Parse a rate in MB/s, above 0 and at most 1 TB/s; -1 on error. */
+static double parse_rate(const char *s) {
+    char *end;
+    errno = 0;
+    double v = strtod(s, &end);
+    if (errno || end == s || *end || !(v > 0 && v <= 1024 * 1024))
+        return -1;
+    return v;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Log-like text, so line, index and compression modes see realistic data. */
+static char *make_pattern(void) {
+    char *p = malloc(PATTERN_SIZE);
+    if (!p)
+        die("malloc");
+    size_t n = 0;
+    unsigned seed = 1;
+    static const char *levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+    while (n < PATTERN_SIZE) {
+        char line[160];
+        seed = seed * 1103515245 + 12345;
+        int len = snprintf(line, sizeof(line),
+                           "2024-05-01T12:%02u:%02u.%03u %s worker-%u request %u took %u us\n",
+                           (seed >> 8) % 60, (seed >> 14) % 60, (seed >> 4) % 1000,
+                           levels[(seed >> 20) % 4], (seed >> 10) % 64,
+                           seed % 100000, (seed >> 6) % 5000);
+        if (n + (size_t)len > PATTERN_SIZE)
+            len = (int)(PATTERN_SIZE - n);
+        memcpy(p + n, line, len);
+        n += (size_t)len;
+    }
+    return p;
+}
+
+/* Write size bytes of the pattern to fd in chunks, at most rate bytes/s. */
+static void generate(int fd, const char *pattern, long long size, size_t chunk,
+                     double rate) {
+    double start = now();
+    long long sent = 0;
+    size_t off = 0;
+    while (sent < size) {
+        size_t n = chunk;
+        if ((long long)n > size - sent)
+            n = (size_t)(size - sent);
+        if (n > PATTERN_SIZE - off)
+            n = PATTERN_SIZE - off;
+        ssize_t nw = write(fd, pattern + off, n);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            die("generator write");
+        }
+        sent += nw;
+        off = (off + (size_t)nw) % PATTERN_SIZE;
+        if (rate > 0) {
+            double due = start + sent / rate;
+            double wait = due - now();
+            if (wait > 0) {
+                struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+}
+
+/* In a child: make fd its stdin or stdout and drop every other descriptor,
+   so no stray pipe end keeps the peer from seeing EOF. */
+static void child_fds(int fd, int target) {
+    if (fd != target && dup2(fd, target) < 0)
+        die("dup2");
+    close_range(3, ~0U, 0);
+}
+
+static pid_t spawn_generator(int fd, const char *pattern, long long size,
+                             size_t chunk, double rate) {
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        child_fds(fd, STDOUT_FILENO);
+        generate(STDOUT_FILENO, pattern, size, chunk, rate);
+        _exit(0);
+    }
+    return pid;
+}
+
+static pid_t spawn_drain(int fd) {
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        static char buf[1 << 16];
+        child_fds(fd, STDIN_FILENO);
+        while (read(STDIN_FILENO, buf, sizeof(buf)) > 0)
+            ;
+        _exit(0);
+    }
+    return pid;
+}
+
+/* read and write syscalls made by a process that has exited but is not
+   reaped yet. */
+static double proc_syscalls(pid_t pid) {
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    double n = 0;
+    unsigned long long v;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "syscr: %llu", &v) == 1 || sscanf(line, "syscw: %llu", &v) == 1)
+            n += (double)v;
+    fclose(f);
+    return n;
+}
+
+static struct result run_once(const char *append, const struct strategy *st,
+                              const char *input, const char *dir, const char *pattern,
+                              long long size, size_t chunk, double rate) {
+    char outpath[4096], infile[4096];
+    snprintf(outpath, sizeof(outpath), "%s/bench_append.out", dir);
+    snprintf(infile, sizeof(infile), "%s/bench_append.in", dir);
+    unlink(outpath);
+
+    /* Input side */
+    int in_rd, in_wr = -1;
+    if (strcmp(input, "file") == 0) {
+        in_rd = open(infile, O_RDONLY);
+        if (in_rd < 0)
+            die(infile);
+    } else {
+        int fds[2];
+        if (strcmp(input, "socket") == 0) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+                die("socketpair");
+        } else if (pipe(fds) < 0) {
+            die("pipe");
+        }
+        in_rd = fds[0];
+        in_wr = fds[1];
+    }
+
+    /* stdout side */
+    int out[2];
+    if (pipe(out) < 0)
+        die("pipe");
+
+    /* argv: append <options> outpath */
+    char *args = strdup(st->args);
+    char *argv[64];
+    int argc = 0;
+    argv[argc++] = (char *)append;
+    for (char *tok = strtok(args, " "); tok && argc < 62; tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc++] = outpath;
+    argv[argc] = NULL;
+
+    double t0 = now();
+    pid_t gen = -1;
+    if (in_wr >= 0)
+        gen = spawn_generator(in_wr, pattern, size, chunk, rate);
+    pid_t drain = spawn_drain(out[0]);
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        if (dup2(out[1], STDOUT_FILENO) < 0)
+            die("dup2");
+        child_fds(in_rd, STDIN_FILENO);
+        execvp(append, argv);
+        perror(append);
+        _exit(127);
+    }
+    close(in_rd);
+    close(out[0]);
+    close(out[1]);
+    if (in_wr >= 0)
+        close(in_wr);
+
+    /* Read the counters before the zombie is reaped */
+    siginfo_t si;
+    if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) < 0)
+        die("waitid");
+    double t1 = now();
+    struct result r = { t1 - t0, proc_syscalls(pid), 0 };
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+        die("wait4");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "strategy '%s' failed\n", st->name);
+        r.secs = -1;
+    }
+    r.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    if (gen > 0)
+        waitpid(gen, NULL, 0);
+    waitpid(drain, NULL, 0);
+    unlink(outpath);
+    free(args);
+    return r;
+}
+
+static int cmp_result(const void *a, const void *b) {
+    double x = ((const struct result *)a)->secs, y = ((const struct result *)b)->secs;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    const char *append = "./append";
+    const char *input = "pipe";
+    const char *dir = ".";
+    size_t chunk = 64 * 1024;
+    double rate = 0;
+    long long size = 1LL << 30;
+    int runs = 3;
+    struct strategy strategies[MAX_STRATEGIES];
+    int nstrategies = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:i:c:r:s:n:o:S:")) != -1) {
+        switch (opt) {
+        case 'p':
+            append = optarg;
+            break;
+        case 'i':
+            input = optarg;
+            if (strcmp(input, "pipe") && strcmp(input, "socket") && strcmp(input, "file"))
+                usage(argv[0]);
+            break;
+        case 'c':
+            if (parse_size(optarg) < 0)
+                usage(argv[0]);
+            chunk = (size_t)parse_size(optarg);
+            break;
+        case 'r':
+            if ((rate = parse_rate(optarg)) < 0)
+                usage(argv[0]);
+            rate *= 1024 * 1024;
+            break;
+        case 's':
+            if ((size = parse_size(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS)
+                usage(argv[0]);
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        case 'S': {
+            char *eq = strchr(optarg, '=');
+            if (!eq || nstrategies == MAX_STRATEGIES)
+                usage(argv[0]);
+            *eq = '\0';
+            strategies[nstrategies].name = optarg;
+            strategies[nstrategies++].args = eq + 1;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+    if (nstrategies == 0) {
+        nstrategies = sizeof(defaults) / sizeof(defaults[0]);
+        memcpy(strategies, defaults, sizeof(defaults));
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char *pattern = make_pattern();
+    if (strcmp(input, "file") == 0) {
+        /* Generated once, outside the timed runs */
+        char infile[4096];
+        snprintf(infile, sizeof(infile), "%s/bench_append.in", dir);
+        int fd = open(infile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            die(infile);
+        generate(fd, pattern, size, 1 << 20, 0);
+        close(fd);
+    }
+
+    printf("input %s, %lld MB in %zu-byte chunks", input, size >> 20, chunk);
+    if (rate > 0)
+        printf(", capped at %.0f MB/s", rate / (1024 * 1024));
+    printf(", median of %d\n\n", runs);
+    printf("%-20s %10s %14s %10s\n", "strategy", "GB/s", "syscalls/GB", "CPU s/GB");
+
+    double gb = size / (double)(1LL << 30);
+    for (int i = 0; i < nstrategies; i++) {
+        /* Failed runs are left out of the median */
+        struct result r[MAX_RUNS];
+        int ok = 0;
+        for (int k = 0; k < runs; k++) {
+            struct result x = run_once(append, &strategies[i], input, dir, pattern,
+                                       size, chunk, rate);
+            if (x.secs >= 0)
+                r[ok++] = x;
+        }
+        if (ok == 0) {
+            printf("%-20s %10s\n", strategies[i].name, "failed");
+            fflush(stdout);
+            continue;
+        }
+        qsort(r, ok, sizeof(r[0]), cmp_result);
+        struct result *m = &r[ok / 2];
+        printf("%-20s %10.2f %14.0f %10.2f", strategies[i].name, gb / m->secs,
+               m->syscalls / gb, m->cpu / gb);
+        if (ok < runs)
+            printf("   (%d of %d runs failed)", runs - ok, runs);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (strcmp(input, "file") == 0) {
+        char infile[4096];
+        snprintf(infile, sizeof(infile), "%s/bench_append.in", dir);
+        unlink(infile);
+    }
+    free(pattern);
+    return EXIT_SUCCESS;
+}
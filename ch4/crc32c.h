@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs.  Start with
+   crc = 0 and feed the previous result back in to checksum data in pieces. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Follow a file written by append, like `tail -F`, but woken by inotify
+ * instead of polling: new data is copied to stdout as soon as it is
+ * written.  The file is followed by name.  When append rotates it (file.N
+ * is split off and a new file renamed into place) the rest of the old
+ * segment is copied out before switching to the new one, and a file that
+ * shrinks is read again from the start.
+ *
+ * Output starts at the end of the file, at offset 0 with -a, or at a given
+ * offset with -o (say one printed by logseek -o).
+ */
+
+#define EVENT_BUF (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-a | -o offset] file\n", progname);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parse a non-negative decimal number; -1 on error. */
+static long long parse_num(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v < 0)
+        return -1;
+    return v;
+}
+
+/* Copy [*pos, end of file) to stdout; a file that got shorter than *pos
+   has been truncated and is copied from the start. */
+static void copy_new(int fd, off_t *pos, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        die("fstat");
+    if (st.st_size < *pos) {
+        fprintf(stderr, "follow: %s: file truncated\n", path);
+        *pos = 0;
+    }
+    while (*pos < st.st_size) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, pos, st.st_size - *pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("sendfile");
+        }
+        if (n == 0)
+            break;
+    }
+}
+
+/* Wait for the file to change.  Returns 1 if something was created or
+   renamed under its name, 0 if it was just written to. */
+static int wait_event(int ifd, int dir_wd, const char *name) {
+    char buf[EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(ifd, buf, sizeof(buf))) < 0) {
+        if (errno != EINTR)
+            die("read inotify");
+    }
+    int renamed = 0;
+    for (char *p = buf; p < buf + n;) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        if (ev->wd == dir_wd && ev->len && strcmp(ev->name, name) == 0)
+            renamed = 1;
+        p += sizeof(*ev) + ev->len;
+    }
+    return renamed;
+}
+
+/* The name now refers to a different file than the one we have open. */
+static int replaced(int fd, const char *path) {
+    struct stat a, b;
+    if (stat(path, &b) < 0)
+        return 0;
+    if (fstat(fd, &a) < 0)
+        die("fstat");
+    return a.st_ino != b.st_ino || a.st_dev != b.st_dev;
+}
+
+int main(int argc, char *argv[]) {
+    int from_start = 0;
+    off_t start = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ao:")) != -1) {
+        switch (opt) {
+        case 'a':
+            from_start = 1;
+            break;
+        case 'o':
+            start = parse_num(optarg);
+            if (start < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || (from_start && start >= 0))
+        usage(argv[0]);
+    const char *path = argv[optind];
+
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0)
+        die("inotify_init1");
+
+    /* The directory tells us when the name is created or renamed over */
+    char dir[PATH_MAX], base[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(base, sizeof(base), "%s", path);
+    const char *name = basename(base);
+    int dir_wd = inotify_add_watch(ifd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+    if (dir_wd < 0)
+        die("inotify_add_watch");
+
+    int fd;
+    while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT)
+            die("open");
+        wait_event(ifd, dir_wd, name);
+    }
+    int wd = inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB);
+    if (wd < 0)
+        die("inotify_add_watch");
+
+    off_t pos = 0;
+    if (start >= 0) {
+        pos = start;
+    } else if (!from_start) {
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+            die("fstat");
+        pos = st.st_size;
+    }
+
+    /* The watches are in place before the first copy, so nothing is missed */
+    int renamed = 0;
+    for (;;) {
+        copy_new(fd, &pos, path);
+        if (renamed && replaced(fd, path)) {
+            /* Rotated: finish the old segment, then start on the new file */
+            copy_new(fd, &pos, path);
+            close(fd);
+            inotify_rm_watch(ifd, wd);
+            if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+                die("open");
+            if ((wd = inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB)) < 0)
+                die("inotify_add_watch");
+            pos = 0;
+            renamed = 0;
+            continue;
+        }
+        renamed = wait_event(ifd, dir_wd, name);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+/*
+ * Record framing written by `append --frame` and read back by framescan.
+ * Every record is an 8-byte header followed by the payload:
+ *
+ *   u32  payload length, little-endian
+ *   u32  CRC-32C of the four length bytes and then the payload, little-endian
+ *
+ * A record whose length is out of range, that runs past the end of the
+ * file, or whose checksum does not match marks the end of the valid data.
+ */
+#define FRAME_HDR 8
+#define FRAME_MAX (256u << 20)          /* longer lengths mean corruption */
+
+static inline void frame_put32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t frame_get32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif /* FRAME_H */
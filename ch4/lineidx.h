@@ -0,0 +1,63 @@
+#ifndef LINEIDX_H
+#define LINEIDX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Sidecar index written by `append --index` next to the log (log.idx) and
+ * used by logseek.  It is a flat array of fixed-size entries in host byte
+ * order, sorted by line and offset.  An entry is written for every Nth line
+ * and/or for the first line of every time bucket.  Entries are flushed in
+ * batches, so after a crash the index may lag the log, never lead it.
+ */
+struct lineidx_entry {
+    uint64_t line;              /* 0-based line number */
+    uint64_t offset;            /* byte offset of the start of that line */
+    int64_t time;               /* its timestamp, LINEIDX_NO_TIME if none */
+};
+
+#define LINEIDX_NO_TIME INT64_MIN
+#define LINEIDX_HEAD 32         /* bytes of a line looked at for a timestamp */
+
+static inline int lineidx_digits(const char *p, int n, int *v) {
+    *v = 0;
+    for (int i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return 0;
+        *v = *v * 10 + (p[i] - '0');
+    }
+    return 1;
+}
+
+/*
+ * Parse the timestamp a line starts with, in seconds since the epoch:
+ * either "YYYY-MM-DD[T ]HH:MM:SS" (UTC) or plain epoch seconds with at
+ * least nine digits.  Returns LINEIDX_NO_TIME if there is none.
+ */
+static inline int64_t lineidx_parse_time(const char *p, size_t n) {
+    struct tm tm;
+    int v[6];
+    memset(&tm, 0, sizeof(tm));
+    if (n >= 19 && p[4] == '-' && p[7] == '-' && (p[10] == 'T' || p[10] == ' ') &&
+        p[13] == ':' && p[16] == ':' &&
+        lineidx_digits(p, 4, &v[0]) && lineidx_digits(p + 5, 2, &v[1]) &&
+        lineidx_digits(p + 8, 2, &v[2]) && lineidx_digits(p + 11, 2, &v[3]) &&
+        lineidx_digits(p + 14, 2, &v[4]) && lineidx_digits(p + 17, 2, &v[5])) {
+        tm.tm_year = v[0] - 1900;
+        tm.tm_mon = v[1] - 1;
+        tm.tm_mday = v[2];
+        tm.tm_hour = v[3];
+        tm.tm_min = v[4];
+        tm.tm_sec = v[5];
+        return (int64_t)timegm(&tm);
+    }
+    size_t i = 0;
+    int64_t t = 0;
+    while (i < n && i < 18 && p[i] >= '0' && p[i] <= '9')
+        t = t * 10 + (p[i++] - '0');
+    return i >= 9 ? t : LINEIDX_NO_TIME;
+}
+
+#endif /* LINEIDX_H */
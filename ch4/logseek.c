@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "lineidx.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Print a log written by `append --index` starting at line K (-l) or at the
+ * first line stamped at or after time T (-t).  The sidecar index gets us to
+ * within one index interval of the target; only that stretch is scanned.
+ * With -o just the byte offset is printed.
+ */
+
+#define BUF_SIZE (1024 * 1024)
+
+/* A window of the log, refilled on demand. */
+struct reader {
+    int fd;
+    char *buf;
+    off_t off;                  /* file offset of buf[0] */
+    size_t len;
+};
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-o] -l line | -t time file\n", progname);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parse a non-negative decimal number; -1 on error. */
+static long long parse_num(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v < 0)
+        return -1;
+    return v;
+}
+
+/* Make at least `need` bytes from pos available unless EOF comes first;
+   returns a pointer to pos and the number of bytes available. */
+static const char *reader_at(struct reader *r, off_t pos, size_t need, size_t *avail) {
+    if (pos < r->off || pos + (off_t)need > r->off + (off_t)r->len) {
+        ssize_t nr = pread(r->fd, r->buf, BUF_SIZE, pos);
+        if (nr < 0)
+            die("read");
+        r->off = pos;
+        r->len = (size_t)nr;
+    }
+    *avail = (size_t)(r->off + (off_t)r->len - pos);
+    return r->buf + (pos - r->off);
+}
+
+/* Offset just past the newline ending the line at pos, or -1 at EOF. */
+static off_t next_line(struct reader *r, off_t pos) {
+    for (;;) {
+        size_t avail;
+        const char *p = reader_at(r, pos, 1, &avail);
+        if (avail == 0)
+            return -1;
+        const char *nl = memchr(p, '\n', avail);
+        if (nl)
+            return pos + (nl - p) + 1;
+        pos += (off_t)avail;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int offset_only = 0, by_time = 0, have_target = 0;
+    long long line = 0;
+    int64_t when = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ol:t:")) != -1) {
+        switch (opt) {
+        case 'o':
+            offset_only = 1;
+            break;
+        case 'l':
+            line = parse_num(optarg);
+            have_target = line >= 0;
+            break;
+        case 't':
+            when = lineidx_parse_time(optarg, strlen(optarg));
+            by_time = have_target = when != LINEIDX_NO_TIME;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || !have_target)
+        usage(argv[0]);
+    const char *path = argv[optind];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("open");
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        die("fstat");
+
+    /* Load the index; entries past the end of the log are ignored */
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s.idx", path);
+    struct lineidx_entry *idx = NULL;
+    size_t n = 0;
+    int ifd = open(name, O_RDONLY);
+    if (ifd >= 0) {
+        struct stat ist;
+        if (fstat(ifd, &ist) < 0)
+            die("fstat index");
+        n = (size_t)ist.st_size / sizeof(*idx);
+        if (n > 0) {
+            if (!(idx = malloc(n * sizeof(*idx))))
+                die("malloc");
+            if (pread(ifd, idx, n * sizeof(*idx), 0) != (ssize_t)(n * sizeof(*idx)))
+                die("read index");
+        }
+        close(ifd);
+        while (n > 0 && idx[n - 1].offset > (uint64_t)st.st_size)
+            n--;
+    } else if (errno != ENOENT) {
+        die("open index");
+    }
+
+    /* Binary search for the last entry at or before the target */
+    off_t pos = 0;
+    uint64_t at_line = 0;
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int before = by_time ? (idx[mid].time != LINEIDX_NO_TIME && idx[mid].time < when)
+                             : idx[mid].line <= (uint64_t)line;
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0) {
+        pos = (off_t)idx[lo - 1].offset;
+        at_line = idx[lo - 1].line;
+    }
+
+    /* Scan forward from there */
+    struct reader r = { .fd = fd, .off = 0, .len = 0 };
+    if (!(r.buf = malloc(BUF_SIZE)))
+        die("malloc");
+    while (pos >= 0 && pos < st.st_size) {
+        if (by_time) {
+            size_t avail;
+            const char *p = reader_at(&r, pos, LINEIDX_HEAD, &avail);
+            const char *nl = memchr(p, '\n', avail < LINEIDX_HEAD ? avail : LINEIDX_HEAD);
+            int64_t t = lineidx_parse_time(p, nl ? (size_t)(nl - p) :
+                                           (avail < LINEIDX_HEAD ? avail : LINEIDX_HEAD));
+            if (t != LINEIDX_NO_TIME && t >= when)
+                break;
+        } else if (at_line == (uint64_t)line) {
+            break;
+        }
+        pos = next_line(&r, pos);
+        at_line++;
+    }
+    if (pos < 0)
+        pos = st.st_size;
+
+    if (offset_only) {
+        printf("%lld\n", (long long)pos);
+        return EXIT_SUCCESS;
+    }
+    while (pos < st.st_size) {
+        ssize_t nw = sendfile(STDOUT_FILENO, fd, &pos, st.st_size - pos);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            die("sendfile");
+        }
+        if (nw == 0)
+            break;
+    }
+    free(r.buf);
+    free(idx);
+    close(fd);
+    return EXIT_SUCCESS;
+}
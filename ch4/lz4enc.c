@@ -0,0 +1,141 @@
+#include "lz4enc.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5         /* a block always ends with 5 literals */
+#define MF_LIMIT 12             /* no match may start in the last 12 bytes */
+#define MAX_OFFSET 65535
+#define HASH_LOG 16
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* xxHash32, only needed for the frame header checksum. */
+static uint32_t rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32_small(const unsigned char *p, size_t len, uint32_t seed) {
+    const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u,
+                   P4 = 668265263u, P5 = 374761393u;
+    uint32_t h = seed + P5 + (uint32_t)len;     /* inputs below 16 bytes only */
+    while (len >= 4) {
+        h = rotl(h + read32(p) * P3, 17) * P4;
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0)
+        h = rotl(h + *p++ * P5, 11) * P1;
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
+}
+
+size_t lz4_frame_header(unsigned char *out) {
+    out[0] = 0x04; out[1] = 0x22; out[2] = 0x4d; out[3] = 0x18;  /* magic */
+    out[4] = 0x60;              /* version 01, independent blocks */
+    out[5] = 0x60;              /* 1 MB maximum block size */
+    out[6] = (unsigned char)(xxh32_small(out + 4, 2, 0) >> 8);
+    return LZ4_FRAME_HDR;
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* One sequence: literals, then a match (none for the final sequence). */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit,
+                                   size_t nlit, size_t offset, size_t mlen) {
+    unsigned char *token = op++;
+    *token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15)
+        op = put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    mlen -= MIN_MATCH;
+    *token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15)
+        op = put_length(op, mlen - 15);
+    return op;
+}
+
+/*
+ * Greedy single-pass matcher, the same scheme as the reference "fast"
+ * compressor: hash every 4-byte sequence, take the first candidate that
+ * really matches, and step faster through data that keeps missing.
+ */
+size_t lz4_compress_block(const unsigned char *src, size_t n, unsigned char *dst,
+                          uint32_t *table) {
+    unsigned char *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    if (n > MF_LIMIT) {
+        size_t limit = n - MF_LIMIT;
+        size_t match_end = n - LAST_LITERALS;
+        unsigned misses = 0;
+
+        memset(table, 0, LZ4_TABLE_SIZE * sizeof(*table));
+        ip = 1;                 /* table entries hold position + 1; 0 is empty */
+        table[hash4(read32(src))] = 1;
+        while (ip < limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip + 1;
+            if (ref == 0 || ip - (ref - 1) > MAX_OFFSET ||
+                read32(src + ref - 1) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            ref--;
+            misses = 0;
+
+            /* Extend backwards over literals, then forwards */
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = MIN_MATCH;
+            while (ip + mlen + 8 <= match_end) {
+                uint64_t a, b;
+                memcpy(&a, src + ip + mlen, 8);
+                memcpy(&b, src + ref + mlen, 8);
+                if (a != b) {
+                    mlen += (size_t)__builtin_ctzll(a ^ b) >> 3;
+                    goto matched;
+                }
+                mlen += 8;
+            }
+            while (ip + mlen < match_end && src[ip + mlen] == src[ref + mlen])
+                mlen++;
+        matched:
+            op = put_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+            ip += mlen;
+            anchor = ip;
+            if (ip < limit)
+                table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2) + 1;
+        }
+    }
+    op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
@@ -0,0 +1,32 @@
+#ifndef LZ4ENC_H
+#define LZ4ENC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal LZ4 compressor: the block format plus just enough of the frame
+ * format (independent 1 MB blocks, no checksums) for `lz4 -d` to read the
+ * result.  A frame is lz4_frame_header(), then for each block a 4-byte
+ * little-endian size followed by the data, then LZ4_END_MARK.
+ */
+#define LZ4_BLOCK_MAX (1024 * 1024)
+#define LZ4_FRAME_HDR 7
+#define LZ4_END_MARK 4                  /* bytes: a zero block size */
+#define LZ4_UNCOMPRESSED 0x80000000u    /* block size flag: stored as is */
+#define LZ4_TABLE_SIZE (1 << 16)        /* entries in the match table */
+
+/* Worst-case compressed size of n bytes. */
+static inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+/* Write the frame header to out; returns LZ4_FRAME_HDR. */
+size_t lz4_frame_header(unsigned char *out);
+
+/* Compress src[0..n) into dst, which must hold lz4_bound(n) bytes.  table
+   is scratch space of LZ4_TABLE_SIZE entries.  Returns the compressed size. */
+size_t lz4_compress_block(const unsigned char *src, size_t n, unsigned char *dst,
+                          uint32_t *table);
+
+#endif /* LZ4ENC_H */
@@ -0,0 +1,89 @@
+#include "nlscan.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD 1
+#endif
+
+/* Portable fallback, and the tail after the last whole block. */
+static size_t scan_bytes(const char *buf, size_t i, size_t len, uint32_t *offs,
+                         size_t k, size_t max, size_t *done) {
+    const char *nl;
+    while (k < max && (nl = memchr(buf + i, '\n', len - i))) {
+        i = (size_t)(nl - buf);
+        offs[k++] = (uint32_t)i++;
+    }
+    *done = k == max ? i : len;
+    return k;
+}
+
+#ifdef HAVE_SIMD
+/* Report the set bits of mask as offsets from base; 1 if offs filled up. */
+#define TAKE_MASK(mask, base)                                   \
+    while (mask) {                                              \
+        size_t at_ = (base) + (size_t)__builtin_ctz(mask);      \
+        offs[k++] = (uint32_t)at_;                              \
+        mask &= mask - 1;                                       \
+        if (k == max) {                                         \
+            *done = at_ + 1;                                    \
+            return k;                                           \
+        }                                                       \
+    }
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, uint32_t *offs, size_t max,
+                        size_t *done) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0, k = 0;
+    if (max == 0) {
+        *done = 0;
+        return 0;
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        TAKE_MASK(mask, i);
+    }
+    return scan_bytes(buf, i, len, offs, k, max, done);
+}
+
+static size_t scan_sse2(const char *buf, size_t len, uint32_t *offs, size_t max,
+                        size_t *done) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0, k = 0;
+    if (max == 0) {
+        *done = 0;
+        return 0;
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        TAKE_MASK(mask, i);
+    }
+    return scan_bytes(buf, i, len, offs, k, max, done);
+}
+#endif
+
+static size_t scan_generic(const char *buf, size_t len, uint32_t *offs, size_t max,
+                           size_t *done) {
+    return scan_bytes(buf, 0, len, offs, 0, max, done);
+}
+
+static size_t (*impl)(const char *, size_t, uint32_t *, size_t, size_t *);
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void impl_init(void) {
+    impl = scan_generic;
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    impl = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+size_t nl_scan(const char *buf, size_t len, uint32_t *offs, size_t max, size_t *done) {
+    pthread_once(&impl_once, impl_init);
+    return impl(buf, len, offs, max, done);
+}
@@ -0,0 +1,19 @@
+#ifndef NLSCAN_H
+#define NLSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Find the newlines in buf[0..len) and store their offsets in offs, at most
+ * max of them.  Returns how many were stored.  *done is set to how far the
+ * scan got: len if every newline was reported, otherwise just past the last
+ * one stored, so the caller can continue from there.
+ *
+ * Whole 32- or 16-byte blocks are compared at once with AVX2 or SSE2 and
+ * every newline in a block is taken from one bitmask, which beats calling
+ * memchr() once per line when lines are short.
+ */
+size_t nl_scan(const char *buf, size_t len, uint32_t *offs, size_t max, size_t *done);
+
+#endif /* NLSCAN_H */
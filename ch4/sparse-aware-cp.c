@@ -1,27 +1,902 @@
-
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD 1
+#endif
 
 #define BUF_SIZE 65536    /* 64 KB buffer */
+#define PIECE    (16 << 20) /* -j: extents are shared out in 16 MB pieces */
+#define MAX_JOBS 256
+#define QD       32         /* -u: read/write pairs in flight */
+#define TREE_JOBS 8         /* -r: default pool size */
+#define LINK_BUCKETS 4096   /* -r: hash of multiply linked files */
+#define SLOT     (256 << 10) /* -u: one registered buffer per pair */
+
+/* An allocated stretch of the source: [off, off + len) */
+struct extent {
+    off_t off;
+    off_t len;
+};
+
+/* The copy schedule, worked through by one or more threads */
+struct job {
+    int infd, outfd;
+    struct extent *ext;
+    size_t n;
+    size_t blksize;
+    atomic_size_t next;         /* first extent nobody has taken yet */
+    atomic_int user_copy;       /* read and zero-scan instead of copy_file_range */
+};
 
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+static void add_extent(struct extent **ext, size_t *n, size_t *cap,
+                       off_t off, off_t len) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        struct extent *p = realloc(*ext, *cap * sizeof(**ext));
+        if (!p) die("realloc");
+        *ext = p;
+    }
+    (*ext)[*n].off = off;
+    (*ext)[*n].len = len;
+    (*n)++;
+}
+
+/*
+ * List the data extents of fd with SEEK_DATA/SEEK_HOLE, so holes can be
+ * skipped without reading them.  Filesystems that do not track holes
+ * report the whole file as data, as does a kernel without SEEK_DATA.
+ */
+static struct extent *seek_extents(int fd, off_t size, size_t *n) {
+    struct extent *ext = NULL;
+    size_t cap = 0;
+    off_t pos = 0;
+
+    *n = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break;          /* only a hole left */
+        if (data < 0 && errno == EINVAL) {
+            add_extent(&ext, n, &cap, pos, size - pos);
+            break;
+        }
+        if (data < 0) die("lseek SEEK_DATA");
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) die("lseek SEEK_HOLE");
+        if (hole > size) hole = size;
+        if (hole > data)
+            add_extent(&ext, n, &cap, data, hole - data);
+        pos = hole;
+    }
+    return ext;
+}
+
+/*
+ * List the written extents of fd with one FS_IOC_FIEMAP call (two if the
+ * first one only counts them).  Preallocated but unwritten extents read as
+ * zeros and are treated as holes.  Returns -1 if the filesystem has no
+ * FIEMAP, so the caller can fall back to seek_extents().
+ */
+static int fiemap_extents(int fd, off_t size, struct extent **out, size_t *n) {
+    struct fiemap probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.fm_length = FIEMAP_MAX_OFFSET;
+    probe.fm_flags  = FIEMAP_FLAG_SYNC;        /* resolve delayed allocation */
+    if (ioctl(fd, FS_IOC_FIEMAP, &probe) < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL)
+            return -1;
+        die("FS_IOC_FIEMAP");
+    }
+
+    struct extent *ext = NULL;
+    size_t cap = 0;
+    __u64 start = 0;
+    __u32 count = probe.fm_mapped_extents + 16;     /* room for some growth */
+    struct fiemap *fm = malloc(sizeof(*fm) + count * sizeof(struct fiemap_extent));
+    if (!fm) die("malloc");
+
+    *n = 0;
+    for (;;) {
+        memset(fm, 0, sizeof(*fm));
+        fm->fm_start        = start;
+        fm->fm_length       = FIEMAP_MAX_OFFSET - start;
+        fm->fm_flags        = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = count;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) die("FS_IOC_FIEMAP");
+        if (fm->fm_mapped_extents == 0) break;
+
+        int last = 0;
+        for (__u32 i = 0; i < fm->fm_mapped_extents; i++) {
+            struct fiemap_extent *fe = &fm->fm_extents[i];
+            last = fe->fe_flags & FIEMAP_EXTENT_LAST;
+            start = fe->fe_logical + fe->fe_length;
+            if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) continue;
+            if ((off_t)fe->fe_logical >= size) continue;
+            off_t len = (off_t)fe->fe_length;
+            if ((off_t)fe->fe_logical + len > size)
+                len = size - (off_t)fe->fe_logical;
+            add_extent(&ext, n, &cap, (off_t)fe->fe_logical, len);
+        }
+        /* A full buffer without the last extent: the file grew, go on */
+        if (last || fm->fm_mapped_extents < count || (off_t)start >= size) break;
+    }
+    free(fm);
+    *out = ext;
+    return 0;
+}
+
+static int cmp_extent(const void *a, const void *b) {
+    off_t x = ((const struct extent *)a)->off;
+    off_t y = ((const struct extent *)b)->off;
+    return (x > y) - (x < y);
+}
+
+/* Cut extents at multiples of PIECE, so -j threads get even shares even
+   when the file is one huge extent. */
+static void split_extents(struct extent **ext, size_t *n) {
+    struct extent *out = NULL;
+    size_t k = 0, cap = 0;
+    for (size_t i = 0; i < *n; i++) {
+        off_t pos = (*ext)[i].off;
+        off_t end = (*ext)[i].off + (*ext)[i].len;
+        while (pos < end) {
+            off_t cut = (pos / PIECE + 1) * PIECE;
+            if (cut > end) cut = end;
+            add_extent(&out, &k, &cap, pos, cut - pos);
+            pos = cut;
+        }
+    }
+    free(*ext);
+    *ext = out;
+    *n = k;
+}
+
+/* Sort the extents and merge neighbours, so a fragmented file is read in
+   as few, as large, pieces as possible. */
+static void plan_extents(struct extent *ext, size_t *n) {
+    if (*n == 0) return;
+    qsort(ext, *n, sizeof(*ext), cmp_extent);
+    size_t k = 0;
+    for (size_t i = 1; i < *n; i++) {
+        off_t end = ext[k].off + ext[k].len;
+        if (ext[i].off <= end) {
+            if (ext[i].off + ext[i].len > end)
+                ext[k].len = ext[i].off + ext[i].len - ext[k].off;
+        }
+        else {
+            ext[++k] = ext[i];
+        }
+    }
+    *n = k + 1;
+}
+
+/*
+ * Copy one data extent inside the kernel.  Returns -1 if copy_file_range
+ * cannot be used for these files (old kernel, different filesystem types),
+ * with e trimmed to whatever is still left to copy.
+ */
+static int copy_range(int infd, int outfd, struct extent *e) {
+    while (e->len > 0) {
+        loff_t in  = e->off;
+        loff_t out = e->off;
+        ssize_t n = copy_file_range(infd, &in, outfd, &out, (size_t)e->len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                      errno == EOPNOTSUPP))
+            return -1;
+        if (n < 0) die("copy_file_range");
+        if (n == 0) break;                      /* source shrank under us */
+        e->off += n;
+        e->len -= n;
+    }
+    return 0;
+}
+
+/* ---- zero detection: is a whole block zero? ---- */
+
+/* Portable fallback, a word at a time, and the tail of the SIMD versions */
+static int zero_words(const unsigned char *p, size_t len) {
+    uint64_t acc = 0, w;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, p + i, 8);
+        acc |= w;
+    }
+    for (; i < len; i++) acc |= p[i];
+    return acc == 0;
+}
+
+#ifdef HAVE_SIMD
+__attribute__((target("avx2")))
+static int zero_avx2(const unsigned char *p, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+        __m256i v = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(v, v)) return 0;
+    }
+    return zero_words(p + i, len - i);
+}
+
+static int zero_sse2(const unsigned char *p, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) return 0;
+    }
+    return zero_words(p + i, len - i);
+}
+#endif
+
+static int (*is_zero)(const unsigned char *, size_t) = zero_words;
+
+static void zero_init(void) {
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    is_zero = __builtin_cpu_supports("avx2") ? zero_avx2 : zero_sse2;
+#endif
+}
+
+/*
+ * Copy one data extent a filesystem block at a time.  All-zero blocks are
+ * left as holes; runs of other blocks are written with one pwrite each.
+ * Reads end on block boundaries so blocks line up with the destination's.
+ */
+static void copy_extent(int infd, int outfd, const struct extent *e,
+                        unsigned char *buf, size_t blksize) {
+    size_t bufsize = (BUF_SIZE + blksize - 1) / blksize * blksize;
+    off_t pos = e->off;
+    off_t end = e->off + e->len;
+
+    while (pos < end) {
+        size_t want = bufsize - (size_t)(pos % (off_t)blksize);
+        if (end - pos < (off_t)want) want = (size_t)(end - pos);
+        ssize_t nread = pread(infd, buf, want, pos);
+        if (nread < 0) die("read source");
+        if (nread == 0) break;                  /* source shrank under us */
+
+        size_t i   = 0;
+        size_t run = 0;                         /* non-zero bytes before i */
+        while (i < (size_t)nread) {
+            size_t b = blksize - (size_t)((pos + (off_t)i) % (off_t)blksize);
+            if (b > (size_t)nread - i) b = (size_t)nread - i;
+            if (is_zero(buf + i, b)) {
+                /* Zero block: write out the run before it, leave a hole */
+                if (run > 0) {
+                    ssize_t written = pwrite(outfd, buf + i - run, run,
+                                             pos + (off_t)(i - run));
+                    if (written < 0 || (size_t)written != run)
+                        die("write dest");
+                    run = 0;
+                }
+            }
+            else {
+                run += b;
+            }
+            i += b;
+        }
+        if (run > 0) {
+            ssize_t written = pwrite(outfd, buf + i - run, run, pos + (off_t)(i - run));
+            if (written < 0 || (size_t)written != run)
+                die("write dest");
+        }
+        pos += nread;
+    }
+}
+
+/*
+ * Take extents off the schedule until it is empty.  Every extent is copied
+ * with pread/pwrite or copy_file_range at its own offset, so threads never
+ * share a file position; the holes between them need no coordination.
+ */
+static void *copy_worker(void *arg) {
+    struct job *job = arg;
+    unsigned char *buf = NULL;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n) {
+        struct extent e = job->ext[i];
+        if (!atomic_load(&job->user_copy) &&
+            copy_range(job->infd, job->outfd, &e) == 0)
+            continue;
+        atomic_store(&job->user_copy, 1);
+        if (!buf) {
+            buf = malloc(BUF_SIZE + job->blksize);
+            if (!buf) die("malloc");
+        }
+        copy_extent(job->infd, job->outfd, &e, buf, job->blksize);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* ---- io_uring engine (-u) ---- */
+
+/* The two rings, mapped from the kernel; there is no liburing here. */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned tail;              /* our copy of *sq_tail, ahead until submit */
+    unsigned queued;            /* SQEs not yet handed to the kernel */
+};
+
+/* One buffer's worth of the copy: a read linked to the write of its data */
+struct slot {
+    off_t off;
+    size_t len;
+    int pending;                /* CQEs still to come, 0 when idle */
+    int read_res, write_res;
+};
+
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) die("mmap io_uring");
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) die("mmap io_uring");
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) die("mmap io_uring");
+
+    r->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->tail       = *r->sq_tail;
+    r->queued     = 0;
+    return 0;
+}
+
+/* Free SQ entries; ones the kernel has not consumed yet still count */
+static unsigned uring_space(struct uring *r) {
+    return r->sq_entries - (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    if (uring_space(r) == 0) return NULL;
+    unsigned i = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[i] = i;
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+/* Hand queued SQEs to the kernel and wait for at least one completion */
+static void uring_enter(struct uring *r) {
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) { r->queued -= (unsigned)n; return; }
+        if (errno != EINTR) die("io_uring_enter");
+    }
+}
+
+static void uring_rw(struct io_uring_sqe *sqe, int op, int fd, struct slot *s,
+                     struct iovec *iov, unsigned idx, int is_write) {
+    sqe->opcode    = (unsigned char)op;
+    sqe->fd        = fd;
+    sqe->off       = (unsigned long long)s->off;
+    sqe->addr      = (unsigned long long)(uintptr_t)iov->iov_base;
+    sqe->len       = (unsigned)s->len;
+    if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED)
+        sqe->buf_index = (unsigned short)idx;
+    sqe->user_data = (unsigned long long)idx << 1 | (unsigned)is_write;
+}
+
+/* A pair has completed; a short read or write is finished off with pwrite */
+static void slot_done(struct slot *s, int outfd, const struct iovec *iov) {
+    if (s->read_res < 0) { errno = -s->read_res; die("read source"); }
+    size_t got  = (size_t)s->read_res;          /* short: source shrank */
+    size_t done = 0;
+    if (s->write_res >= 0) done = (size_t)s->write_res;
+    else if (s->write_res != -ECANCELED) { errno = -s->write_res; die("write dest"); }
+    while (done < got) {
+        ssize_t w = pwrite(outfd, (char *)iov->iov_base + done, got - done,
+                           s->off + (off_t)done);
+        if (w < 0) die("write dest");
+        done += (size_t)w;
+    }
+}
+
+/*
+ * Copy the schedule through io_uring: QD buffers are registered once and
+ * each carries a READ_FIXED linked to a WRITE_FIXED of the same range, so
+ * the kernel starts the write as soon as the read is done and QD pairs are
+ * in flight at all times.  Registering pins the buffers, which can exceed
+ * RLIMIT_MEMLOCK for an ordinary user; then plain READ/WRITE on the same
+ * buffers are used instead.  Holes are never read, since only extents are
+ * queued; zeros inside them are written like any data.  Returns -1 if the
+ * kernel has no io_uring, so the caller can copy some other way.
+ */
+static int uring_copy(struct job *job) {
+    struct uring r;
+    if (uring_setup(&r, 2 * QD) < 0) {
+        if (errno == ENOSYS || errno == EPERM || errno == EINVAL) return -1;
+        die("io_uring_setup");
+    }
+
+    struct iovec iov[QD];
+    struct slot slots[QD];
+    char *mem = mmap(NULL, (size_t)QD * SLOT, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) die("mmap");
+    for (unsigned i = 0; i < QD; i++) {
+        iov[i].iov_base = mem + (size_t)i * SLOT;
+        iov[i].iov_len  = SLOT;
+        slots[i].pending = 0;
+    }
+    int read_op = IORING_OP_READ_FIXED, write_op = IORING_OP_WRITE_FIXED;
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, QD) < 0) {
+        if (errno != ENOMEM && errno != EPERM) die("io_uring_register");
+        read_op  = IORING_OP_READ;
+        write_op = IORING_OP_WRITE;
+    }
+
+    size_t i = 0;                               /* next extent to queue */
+    off_t pos = job->n ? job->ext[0].off : 0;   /* and how far into it */
+    unsigned busy = 0;
+    for (;;) {
+        /* Fill every idle slot with the next piece of the schedule */
+        for (unsigned k = 0; k < QD && i < job->n; k++) {
+            struct slot *s = &slots[k];
+            if (s->pending) continue;
+            /* A partial submit leaves SQEs behind; queue a pair only whole */
+            if (uring_space(&r) < 2) break;
+            off_t end = job->ext[i].off + job->ext[i].len;
+            s->off = pos;
+            s->len = end - pos < SLOT ? (size_t)(end - pos) : SLOT;
+            s->pending = 2;
+            pos += (off_t)s->len;
+            if (pos == end && ++i < job->n) pos = job->ext[i].off;
+
+            struct io_uring_sqe *rd = uring_sqe(&r), *wr = uring_sqe(&r);
+            uring_rw(rd, read_op, job->infd, s, &iov[k], k, 0);
+            rd->flags = IOSQE_IO_LINK;
+            uring_rw(wr, write_op, job->outfd, s, &iov[k], k, 1);
+            busy++;
+        }
+        if (busy == 0) break;
+        uring_enter(&r);
+
+        /* Reap; a pair is finished once both of its CQEs are in */
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            struct slot *s = &slots[cqe->user_data >> 1];
+            if (cqe->user_data & 1) s->write_res = cqe->res;
+            else                    s->read_res  = cqe->res;
+            if (--s->pending == 0) {
+                slot_done(s, job->outfd, &iov[cqe->user_data >> 1]);
+                busy--;
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    munmap(mem, (size_t)QD * SLOT);
+    close(r.fd);
+    return 0;
+}
+
+/*
+ * Copy the data of infd to outfd, which is already open and empty: steps
+ * 3-6 of main(), shared by the single file and -r modes.
+ */
+static void copy_fd(int infd, int outfd, off_t size, int zero_scan, int jobs,
+                    int uring) {
+    /* Holes are made a destination block at a time */
+    struct stat dst_st;
+    if (fstat(outfd, &dst_st) < 0) die("fstat dest");
+    size_t blksize = dst_st.st_blksize > 0 ? (size_t)dst_st.st_blksize : 4096;
+
+    /* 3. On a filesystem with reflinks, share the blocks: holes and all */
+    int cloned = !zero_scan && ioctl(outfd, FICLONE, infd) == 0;
+
+    /* 4. Find the data; holes in the source are never read */
+    size_t next = 0;
+    struct extent *ext = NULL;
+    if (!cloned && size > 0) {
+        if (fiemap_extents(infd, size, &ext, &next) < 0)
+            ext = seek_extents(infd, size, &next);
+        plan_extents(ext, &next);
+        if (jobs > 1)
+            split_extents(&ext, &next);
+    }
+
+    /* 5. Copy the data extents in the kernel, or read them and skip the
+          zero blocks inside them too; with -j, on several threads, and with
+          -u through io_uring */
+    struct job job = {
+        .infd = infd, .outfd = outfd, .ext = ext, .n = next, .blksize = blksize,
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.user_copy, zero_scan);
+
+    if (uring && next > 0 && uring_copy(&job) == 0)
+        job.n = 0;                              /* nothing left for workers */
+
+    pthread_t tid[MAX_JOBS];
+    int started = 0;
+    for (; started < jobs - 1 && (size_t)started + 1 < next; started++) {
+        int err = pthread_create(&tid[started], NULL, copy_worker, &job);
+        if (err) { errno = err; die("pthread_create"); }
+    }
+    copy_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
+
+    /* 6. Ensure trailing hole (if source ended in a hole) is created */
+    if (ftruncate(outfd, size) < 0)
+        die("ftruncate dest");
+    free(ext);
+}
+
+/* ---- directory trees (-r) ---- */
+
+/* A directory to list or a file to copy, by path relative to the roots */
+struct task {
+    struct task *next;
+    int is_dir;
+    char path[];
+};
+
+/* A file with several links: where its first name was copied to */
+struct link {
+    struct link *next;
+    dev_t dev;
+    ino_t ino;
+    char path[];
+};
+
+/* A directory whose mode could not be set when it was made */
+struct fixup {
+    struct fixup *next;
+    mode_t mode;
+    char path[];
+};
+
+struct tree {
+    int src, dst;               /* the two roots, for openat() and friends */
+    int zero_scan;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct task *queue;
+    size_t pending;             /* queued or running tasks */
+    struct link *links[LINK_BUCKETS];
+    struct fixup *fixups;
+};
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+/* dir/name, where the root directory is "." */
+static void join_path(char *out, size_t size, const char *dir, const char *name) {
+    if (strcmp(dir, ".") == 0) snprintf(out, size, "%s", name);
+    else                       snprintf(out, size, "%s/%s", dir, name);
+}
+
+static void tree_push(struct tree *t, const char *dir, const char *name, int is_dir) {
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    struct task *task = malloc(sizeof(*task) + len);
+    if (!task) die("malloc");
+    join_path(task->path, len, dir, name);
+    task->is_dir = is_dir;
+
+    pthread_mutex_lock(&t->mtx);
+    task->next = t->queue;
+    t->queue = task;
+    t->pending++;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mtx);
+}
+
+/* Make the copy of a directory, writable by us until the tree is done */
+static void tree_mkdir(struct tree *t, const char *path, mode_t mode) {
+    mode &= 07777;
+    if (mkdirat(t->dst, path, mode | S_IRWXU) < 0 && errno != EEXIST)
+        die("mkdir dest");
+    if ((mode & S_IRWXU) == S_IRWXU)
+        return;
+    struct fixup *f = malloc(sizeof(*f) + strlen(path) + 1);
+    if (!f) die("malloc");
+    f->mode = mode;
+    strcpy(f->path, path);
+    pthread_mutex_lock(&t->mtx);
+    f->next = t->fixups;
+    t->fixups = f;
+    pthread_mutex_unlock(&t->mtx);
+}
+
+/* List a directory; its copy already exists, so its files can go ahead */
+static void tree_dir(struct tree *t, const char *path) {
+    int fd = openat(t->src, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) die("open source dir");
+
+    char buf[32768] __attribute__((aligned(8)));
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            unsigned char type = d->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN || type == DT_DIR) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                    die("fstatat source");
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+                       S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                /* Made here, before anything below it is queued */
+                char sub[PATH_MAX];
+                join_path(sub, sizeof(sub), path, name);
+                tree_mkdir(t, sub, st.st_mode);
+                tree_push(t, path, name, 1);
+            }
+            else if (type == DT_REG) {
+                tree_push(t, path, name, 0);
+            }
+            else if (type == DT_LNK) {
+                char target[PATH_MAX], sub[PATH_MAX];
+                ssize_t len = readlinkat(fd, name, target, sizeof(target) - 1);
+                if (len < 0) die("readlink source");
+                target[len] = '\0';
+                join_path(sub, sizeof(sub), path, name);
+                if (symlinkat(target, t->dst, sub) < 0 && errno != EEXIST)
+                    die("symlink dest");
+            }
+            else {
+                fprintf(stderr, "Skipping special file %s/%s\n", path, name);
+            }
+        }
+    }
+    if (n < 0) die("getdents64");
+    close(fd);
+}
+
+/* First name of a multiply linked file: NULL, after recording path as it */
+static const char *tree_link(struct tree *t, const struct stat *st, const char *path) {
+    size_t b = (size_t)(st->st_ino ^ st->st_dev) % LINK_BUCKETS;
+    for (struct link *l = t->links[b]; l; l = l->next)
+        if (l->ino == st->st_ino && l->dev == st->st_dev)
+            return l->path;
+    struct link *l = malloc(sizeof(*l) + strlen(path) + 1);
+    if (!l) die("malloc");
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    strcpy(l->path, path);
+    l->next = t->links[b];
+    t->links[b] = l;
+    return NULL;
+}
+
+static void tree_file(struct tree *t, const char *path) {
+    int infd = openat(t->src, path, O_RDONLY | O_CLOEXEC);
+    if (infd < 0) die("open source");
+    struct stat st;
+    if (fstat(infd, &st) < 0) die("fstat source");
+
+    /* Later names of a file are links to the first copy.  The lookup and
+       the creation of that copy are done together, so a link never
+       points at nothing. */
+    int outfd = -1;
+    if (st.st_nlink > 1) {
+        pthread_mutex_lock(&t->mtx);
+        const char *first = tree_link(t, &st, path);
+        if (first) {
+            if (linkat(t->dst, first, t->dst, path, 0) < 0 && errno != EEXIST)
+                die("link dest");
+        }
+        else {
+            outfd = openat(t->dst, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                           st.st_mode & 0777);
+            if (outfd < 0) die("open dest");
+        }
+        pthread_mutex_unlock(&t->mtx);
+        if (first) {
+            close(infd);
+            return;
+        }
+    }
+    else {
+        outfd = openat(t->dst, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       st.st_mode & 0777);
+        if (outfd < 0) die("open dest");
+    }
+
+    copy_fd(infd, outfd, st.st_size, t->zero_scan, 1, 0);
+    close(infd);
+    close(outfd);
+}
+
+/* Pool thread: run tasks until there are none queued and none running */
+static void *tree_worker(void *arg) {
+    struct tree *t = arg;
+    pthread_mutex_lock(&t->mtx);
+    for (;;) {
+        while (!t->queue && t->pending > 0)
+            pthread_cond_wait(&t->cond, &t->mtx);
+        if (!t->queue)
+            break;
+        struct task *task = t->queue;
+        t->queue = task->next;
+        pthread_mutex_unlock(&t->mtx);
+
+        if (task->is_dir) tree_dir(t, task->path);
+        else              tree_file(t, task->path);
+        free(task);
+
+        pthread_mutex_lock(&t->mtx);
+        if (--t->pending == 0)
+            pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->mtx);
+    return NULL;
+}
+
+/*
+ * Copy the tree under src to dst on a pool of jobs threads.  Listing a
+ * directory and copying a file are both tasks, so the walk itself runs in
+ * parallel and many small files are in flight at once.
+ */
+static void copy_tree(const char *src, const char *dst, int jobs, int zero_scan) {
+    struct tree t;
+    memset(&t, 0, sizeof(t));
+    t.zero_scan = zero_scan;
+    pthread_mutex_init(&t.mtx, NULL);
+    pthread_cond_init(&t.cond, NULL);
+
+    struct stat st;
+    t.src = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (t.src < 0) die("open source");
+    if (fstat(t.src, &st) < 0) die("fstat source");
+    if (mkdir(dst, (st.st_mode & 07777) | S_IRWXU) < 0 && errno != EEXIST)
+        die("mkdir dest");
+    t.dst = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (t.dst < 0) die("open dest");
+    tree_push(&t, ".", ".", 1);
+
+    pthread_t tid[MAX_JOBS];
+    int started = 0;
+    for (; started < jobs - 1; started++) {
+        int err = pthread_create(&tid[started], NULL, tree_worker, &t);
+        if (err) { errno = err; die("pthread_create"); }
+    }
+    tree_worker(&t);
+    for (int i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
+
+    /* Directories we had to keep writable get their real modes last */
+    for (struct fixup *f = t.fixups, *nf; f; f = nf) {
+        nf = f->next;
+        if (fchmodat(t.dst, f->path, f->mode, 0) < 0) die("chmod dest");
+        free(f);
+    }
+    if (fchmod(t.dst, st.st_mode & 07777) < 0) die("chmod dest");
+    for (size_t b = 0; b < LINK_BUCKETS; b++)
+        for (struct link *l = t.links[b], *nl; l; l = nl) {
+            nl = l->next;
+            free(l);
+        }
+    close(t.src);
+    close(t.dst);
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-z | -u] [-j threads] <source> <dest>\n"
+                    "       %s -r [-z] [-j threads] <source-dir> <dest-dir>\n",
+            progname, progname);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source> <dest>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    int zero_scan = 0;      /* -z: copy in user space, zero blocks become holes */
+    int jobs = 0;           /* -j: copy threads (-r: pool size) */
+    int uring = 0;          /* -u: copy through io_uring */
+    int recursive = 0;      /* -r: copy a directory tree */
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zj:ur")) != -1) {
+        switch (opt) {
+        case 'z':
+            zero_scan = 1;
+            break;
+        case 'u':
+            uring = 1;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1 || jobs > MAX_JOBS)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc || (uring && (zero_scan || jobs > 1 || recursive)))
+        usage(argv[0]);
+    const char *src = argv[optind], *dst = argv[optind + 1];
+    zero_init();
+
+    if (recursive) {
+        copy_tree(src, dst, jobs ? jobs : TREE_JOBS, zero_scan);
+        return EXIT_SUCCESS;
     }
 
     /* 1. Open source for reading and stat it */
-    int infd = open(argv[1], O_RDONLY);
+    int infd = open(src, O_RDONLY);
     if (infd < 0) die("open source");
 
     struct stat st;
@@ -32,53 +907,16 @@ int main(int argc, char *argv[]) {
     }
 
     /* 2. Open/create dest with same permissions, truncate existing */
-    int outfd = open(argv[2],
+    int outfd = open(dst,
                      O_WRONLY | O_CREAT | O_TRUNC,
                      st.st_mode & 0777);
     if (outfd < 0) die("open dest");
 
-    /* 3. Copy, preserving holes */
-    unsigned char *buf = malloc(BUF_SIZE);
-    if (!buf) die("malloc");
-
-    ssize_t nread;
-    while ((nread = read(infd, buf, BUF_SIZE)) > 0) {
-        unsigned char *p     = buf;
-        size_t        togo  = (size_t)nread;
-
-        while (togo > 0) {
-            /* If this byte is zero, scan for a zero-run */
-            if (*p == 0) {
-                size_t z = 1;
-                while (z < togo && p[z] == 0) z++;
-                /* seek forward in output, creating a hole */
-                if (lseek(outfd, (off_t)z, SEEK_CUR) < 0)
-                    die("lseek dest");
-                p   += z;
-                togo -= z;
-            }
-            else {
-                /* Non-zero run: scan and write it */
-                size_t nz = 1;
-                while (nz < togo && p[nz] != 0) nz++;
-                ssize_t written = write(outfd, p, nz);
-                if (written < 0 || (size_t)written != nz)
-                    die("write dest");
-                p   += nz;
-                togo -= nz;
-            }
-        }
-    }
-    if (nread < 0) die("read source");
-
-    /* 4. Ensure trailing hole (if source ended in a hole) is created */
-    if (ftruncate(outfd, st.st_size) < 0)
-        die("ftruncate dest");
+    /* 3.-6. Clone, or copy the data extents, then set the size */
+    copy_fd(infd, outfd, st.st_size, zero_scan, jobs ? jobs : 1, uring);
 
-    /* 5. Clean up */
-    free(buf);
+    /* 7. Clean up */
     close(infd);
     close(outfd);
     return EXIT_SUCCESS;
 }
-